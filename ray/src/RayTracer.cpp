@@ -9,14 +9,41 @@
 
 #include "parser/Tokenizer.h"
 #include "parser/Parser.h"
+#include "SceneObjects/trimesh.h"
 
 #include "ui/TraceUI.h"
 #include <cmath>
 #include <algorithm>
+#include <chrono>
 #include <thread>
+#include <cstdlib>
+#include <new>
 
 extern TraceUI* traceUI;
 
+#ifdef RAY_COUNT_ALLOCS
+// Every heap allocation the program makes, for printAllocStats.  Off by
+// default, since it puts an atomic increment in front of each one.
+static std::atomic<long> allocations( 0 );
+
+void* operator new( std::size_t n )
+{
+	++allocations;
+	if( void* p = std::malloc( n ? n : 1 ) )
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete( void* p ) noexcept
+{
+	std::free( p );
+}
+
+static long allocationCount() { return allocations; }
+#else
+static long allocationCount() { return 0; }
+#endif
+
 #include <iostream>
 #include <fstream>
 
@@ -44,34 +71,26 @@ Vec3d RayTracer::trace(double x, double y)
   return ret;
 }
 
-//perform antialiasing?
-Vec3d RayTracer::tracePixel(int i, int j)
+// Where in the window pixel (i,j) is sampled: fills in xs and ys and
+// returns how many samples there are.
+int RayTracer::samplePositions(int i, int j, double* xs, double* ys) const
 {
-	Vec3d col(0,0,0);
 	int numSamples = 1;
-	double sample_size = 1.0;
-
-	if( ! sceneLoaded() ) 
-		return col;
 
 	if(traceUI->antAlias()) {
 		//just set variables for the different cases
 		switch(traceUI->getSample()) {
 			case 1:
 					numSamples = 1;
-					sample_size = 1.0;
 					break;
 			case 2:
 					numSamples = 4;
-					sample_size = 4.0;
 					break;
 			case 3:
 					numSamples = 9;
-					sample_size = 9.0;
 					break;
 			case 4: 
 					numSamples = 16;
-					sample_size = 16.0;
 					break;
 		}
 	}
@@ -81,7 +100,8 @@ Vec3d RayTracer::tracePixel(int i, int j)
 	double step = 1.0/double((traceUI->getSample()));
 
 	for(int k = 1; k <= numSamples; k++) {
-		col += trace(x,y);
+		xs[k-1] = x;
+		ys[k-1] = y;
 		if(k % traceUI->getSample() == 0) {
 			x = double(i)/double(buffer_width);
 			y = double(j+step)/double(buffer_height);
@@ -89,18 +109,117 @@ Vec3d RayTracer::tracePixel(int i, int j)
 		else
 			x = double(i+step)/double(buffer_width);
 	}
+	return numSamples;
+}
 
+void RayTracer::setPixel(int i, int j, Vec3d col)
+{
 	unsigned char *pixel = buffer + ( i + j * buffer_width ) * 3;
 
-	col = col/sample_size;
-
 	pixel[0] = (int)( 255.0 * col[0]); //r
 	pixel[1] = (int)( 255.0 * col[1]); //g
 	pixel[2] = (int)( 255.0 * col[2]); //b
+}
+
+//perform antialiasing?
+Vec3d RayTracer::tracePixel(int i, int j)
+{
+	Vec3d col(0,0,0);
+
+	if( ! sceneLoaded() ) 
+		return col;
 
+	double xs[MAX_SAMPLES], ys[MAX_SAMPLES];
+	int numSamples = samplePositions(i, j, xs, ys);
+	for(int k = 0; k < numSamples; k++)
+		col += trace(xs[k], ys[k]);
+
+	col = col/double(numSamples);
+	setPixel(i, j, col);
 	return col;
 }
 
+// Trace the pixels [x0,x1) x [y0,y1), at most 8x8 of them, with their
+// primary rays in packets: the k-th sample of every pixel makes up the
+// k-th packet.  Hits are found for the whole packet at once and then
+// shaded one ray at a time, so the image is what tracePixel would give.
+//
+// Reflected and refracted rays are normally traced depth-first from
+// shadeHit.  With streamSecondary() on they are instead gathered for the
+// whole tile and traced a bounce at a time by traceStream, and each
+// sample's colour is summed as the bounces come back.
+void RayTracer::traceTile(int x0, int y0, int x1, int y1)
+{
+	if( ! sceneLoaded() )
+		return;
+	if( TraceUI::m_debug || traceUI->getDepth() < 0 ) {
+		for( int j = y0; j < y1; ++j )
+			for( int i = x0; i < x1; ++i )
+				tracePixel(i, j);
+		return;
+	}
+
+	Vec3d col[RayPacket::MAX];
+	double xs[RayPacket::MAX][MAX_SAMPLES], ys[RayPacket::MAX][MAX_SAMPLES];
+	int numSamples = 0;
+	int n = 0;
+	for( int j = y0; j < y1; ++j )
+		for( int i = x0; i < x1; ++i, ++n )
+			numSamples = samplePositions(i, j, xs[n], ys[n]);
+
+	const bool streaming = traceUI->streamSecondary();
+	std::vector<Vec3d> sampleCol;
+	std::vector<StreamRay> stream;
+	if( streaming )
+		sampleCol.resize(n * numSamples);
+
+	for( int k = 0; k < numSamples; ++k ) {
+		RayPacket packet;
+		for( int q = 0; q < n; ++q ) {
+			ray r(Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY);
+			scene->getCamera().rayThrough(xs[q][k], ys[q][k], r);
+			packet.add(r);
+		}
+		scene->intersect(packet);
+
+		for( int q = 0; q < n; ++q ) {
+			bool hit = (packet.found & RayPacket::bit(q)) != 0;
+			if( streaming ) {
+				int sample = q * numSamples + k;
+				if( hit ) {
+					const isect& i = packet.hit(q);
+					Material blend;
+					const Material& m = i.getMaterial(blend);
+					sampleCol[sample] = m.shade(scene, packet[q], i);
+					if( traceUI->getDepth() > 0 )
+						spawn(packet[q], i, m, Vec3d(1.0, 1.0, 1.0), sample, stream);
+				}
+				else
+					sampleCol[sample] = background(packet[q]);
+				continue;
+			}
+			Vec3d c = hit ? shadeHit(packet[q], packet.hit(q), traceUI->getDepth()) : background(packet[q]);
+			c.clamp();
+			col[q] += c;
+		}
+	}
+
+	if( streaming ) {
+		traceStream(stream, &sampleCol[0]);
+		for( int q = 0; q < n; ++q )
+			for( int k = 0; k < numSamples; ++k ) {
+				Vec3d c = sampleCol[q * numSamples + k];
+				c.clamp();
+				col[q] += c;
+			}
+	}
+
+	n = 0;
+	for( int j = y0; j < y1; ++j )
+		for( int i = x0; i < x1; ++i, ++n )
+			setPixel(i, j, col[n]/double(numSamples));
+}
+
 bool notTIR(double n, Vec3d Norm, Vec3d dir) {
 	bool ret = true;
 	double term = 1 - ((n*n) * (1-pow(Norm.dot(Norm,dir),2)));
@@ -117,107 +236,233 @@ bool notTIR(double n, Vec3d Norm, Vec3d dir) {
 Vec3d RayTracer::traceRay(ray& r, int depth)
 {
 	isect i;
-	Vec3d colorC;
+	if(depth < 0)
+		return Vec3d();
+	if(scene->intersect(r, i))
+		return shadeHit(r, i, depth);
+	return background(r);
+}
+
+// Colour of the ray r, depth levels from the bottom, which hit the scene
+// at i.
+Vec3d RayTracer::shadeHit(ray& r, const isect& i, int depth)
+{
+	Material blend;
+	const Material& m = i.getMaterial(blend);
+	Vec3d colorC = m.shade(scene, r, i); //I from Phone Shading
+	ray refl(r);
+	ray refr(r);
+	int spawned = secondaryRays(r, i, m, refl, refr);
+	if(spawned & REFLECTED)
+		colorC = colorC + (m.kr(i)%traceRay(refl,depth-1));
+	if(spawned & REFRACTED)
+		colorC = colorC + (m.kt(i)%traceRay(refr,depth-1));
+	return colorC;
+}
+
+// Set up the rays reflected and refracted where r hits the scene at i,
+// whose material is m, and say which of them count: a ray whose kr or kt
+// is zero here can't add anything, nor can refraction under total
+// internal reflection.
+int RayTracer::secondaryRays(const ray& r, const isect& i, const Material& m, ray& refl, ray& refr) const
+{
+	int spawned = 0;
 	double n_i;
 	double n_t;
-	if(depth >= 0){
-		if(scene->intersect(r, i)) {
-		  Vec3d Q = r.at(i.t);
-		  Vec3d N = i.N;
-		  const Material& m = i.getMaterial();
-		  colorC = m.shade(scene, r, i); //I from Phone Shading
-		  Vec3d nrDir = -(r.getDirection());
-		  Vec3d R = ((2.0 * nrDir.dot(nrDir,N))*N) - nrDir; //-ray direction
-		  R.normalize();
-		  r.d = R;
-		  r.p = Q;
-		  colorC = colorC + (m.kr(i)%traceRay(r,depth-1));
-
-		  if(N.dot(N,nrDir) > 0.0) { //ray is entering object
-		  	n_i = INDEX_AIR;
-		  	n_t = m.index(i);
-		  }
-		  else { //ray is exiting?
-		  	n_i = m.index(i);
-		  	n_t = INDEX_AIR;
-		  	N *= -1;
-		  }
-
-		  double n = n_i/n_t;
-
-		  if(m.Trans() && notTIR(n, N, nrDir)) {
-		   	double cosIncAngle = N.dot(N,nrDir); //Theta_i
-		   	double term = 1 - ((n*n) * (1-(cosIncAngle*cosIncAngle)));
-		   	double cosTransAngle = sqrt(term);
-		   	Vec3d T = (((n*cosIncAngle) - cosTransAngle)*N) - (n*nrDir);
-		   	T.normalize();
-		   	r.d = T;
-		   	r.p = Q;
-		   	colorC = colorC + (m.kt(i)%traceRay(r,depth-1));
-		  }
-		} 
-		else {
-			// No intersection.  This ray travels to infinity, so we color
-			// it according to the background color, which in this (simple) case
-			// is just black.
-			if(!traceUI->cm()) {
-				colorC = Vec3d(0.0,0.0,0.0);
+	Vec3d Q = r.at(i.t);
+	Vec3d N = i.N;
+	Vec3d nrDir = -(r.getDirection());
+	if(!m.kr(i).iszero()) {
+		Vec3d R = ((2.0 * nrDir.dot(nrDir,N))*N) - nrDir; //-ray direction
+		R.normalize();
+		refl.setDirection(R);
+		refl.p = Q;
+		refl.setInterval();
+		spawned |= REFLECTED;
+	}
+
+	if(N.dot(N,nrDir) > 0.0) { //ray is entering object
+		n_i = INDEX_AIR;
+		n_t = m.index(i);
+	}
+	else { //ray is exiting?
+		n_i = m.index(i);
+		n_t = INDEX_AIR;
+		N *= -1;
+	}
+
+	double n = n_i/n_t;
+
+	if(m.Trans() && !m.kt(i).iszero() && notTIR(n, N, nrDir)) {
+		double cosIncAngle = N.dot(N,nrDir); //Theta_i
+		double term = 1 - ((n*n) * (1-(cosIncAngle*cosIncAngle)));
+		double cosTransAngle = sqrt(term);
+		Vec3d T = (((n*cosIncAngle) - cosTransAngle)*N) - (n*nrDir);
+		T.normalize();
+		refr.setDirection(T);
+		refr.p = Q;
+		refr.setInterval();
+		spawned |= REFRACTED;
+	}
+	return spawned;
+}
+
+// Queue the rays leaving i (material m) on out, each carrying weight
+// times its own kr or kt.
+void RayTracer::spawn(const ray& r, const isect& i, const Material& m, const Vec3d& weight, int sample,
+	std::vector<StreamRay>& out) const
+{
+	ray refl(r);
+	ray refr(r);
+	int spawned = secondaryRays(r, i, m, refl, refr);
+	if(spawned & REFLECTED)
+		out.push_back(StreamRay(refl, weight % m.kr(i), sample));
+	if(spawned & REFRACTED)
+		out.push_back(StreamRay(refr, weight % m.kt(i), sample));
+}
+
+// Trace a tile's secondary rays a bounce at a time down to the depth
+// limit, adding what each brings back to sampleCol.  Every bounce is
+// sorted by direction octant and then by the cell of a 16^3 grid over the
+// scene holding its origin, so rays headed the same way from the same
+// place go through the scene one after another.  A run of at least
+// MIN_PACKET such rays is coherent enough to trace as a packet; shorter
+// runs are traced a ray at a time, still in sorted order.
+void RayTracer::traceStream(std::vector<StreamRay>& stream, Vec3d* sampleCol)
+{
+	const int CELLS = 16;
+	const size_t MIN_PACKET = 8;
+	const Vec3d lo = scene->bounds().getMin();
+	const Vec3d hi = scene->bounds().getMax();
+	std::vector<StreamRay> next;
+	RayPacket packet;
+
+	for( int depth = traceUI->getDepth() - 1; depth >= 0 && !stream.empty(); --depth ) {
+		for( size_t s = 0; s < stream.size(); ++s ) {
+			const ray& r = stream[s].r;
+			unsigned key = 0;
+			for( int axis = 0; axis < 3; ++axis ) {
+				double extent = hi[axis] - lo[axis];
+				int cell = extent > 0.0 ? (int)((r.p[axis] - lo[axis]) / extent * CELLS) : 0;
+				cell = std::max(0, std::min(CELLS - 1, cell));
+				// interleave the cell bits so that nearby cells sort together
+				for( int b = 0; b < 4; ++b )
+					key |= ((cell >> b) & 1u) << (3*b + axis);
 			}
-			else{
-				CubeMap* cm = getCubeMap();
-				TextureMap* tx;
-				Vec2d uv = Vec2d(0.0,0.0);
-
-				//computes max of the absolute value of the ray direction components
-				double majorAxis = fmax(fmax(abs(r.d[0]),abs(r.d[1])), abs(r.d[2]));
-
-				//major axis is x
-				if(abs(r.d[0]) == majorAxis) {
-					if(r.d[0] >= 0) { //major axis is xpos
-						tx = cm->getXpos();
-						uv[0] = (((r.d[2])/majorAxis) + 1.0)/2.0;
-						uv[1] = (((r.d[1])/majorAxis) + 1.0)/2.0;
-						colorC = tx->getMappedValue(uv);
-					}
-					else { //major axis is xneg 
-						tx = cm->getXneg();
-						uv[0] = (-(r.d[2]/majorAxis) + 1.0)/2.0;
-						uv[1] = ((r.d[1]/majorAxis) + 1.0)/2.0;
-						colorC = tx->getMappedValue(uv);
-					}
+			int octant = (r.d[0] < 0.0) | ((r.d[1] < 0.0) << 1) | ((r.d[2] < 0.0) << 2);
+			stream[s].key = ((unsigned)octant << 12) | key;
+		}
+		std::sort(stream.begin(), stream.end(),
+			[](const StreamRay& a, const StreamRay& b) { return a.key < b.key; });
+
+		next.clear();
+		for( size_t first = 0; first < stream.size(); ) {
+			size_t end = first + 1;
+			while( end < stream.size() && end - first < (size_t)RayPacket::MAX && stream[end].key == stream[first].key )
+				++end;
+
+			packet.clear();
+			for( size_t s = first; s < end; ++s )
+				packet.add(stream[s].r);
+			auto start = std::chrono::steady_clock::now();
+			if( end - first >= MIN_PACKET ) {
+				scene->intersect(packet);
+				++streamStats.packets;
+				streamStats.packetRays += (long)(end - first);
+			}
+			else {
+				for( int q = 0; q < packet.size(); ++q ) {
+					isect i;
+					if( scene->intersect(packet[q], i) )
+						packet.offer(q, i);
 				}
-
-				//major axis is y
-				else if(abs(r.d[1]) == majorAxis) {
-					if(r.d[1] >= 0) { //major axis is ypos
-						tx = cm->getYpos();
-						uv[0] = ((r.d[0]/majorAxis) + 1.0)/2.0;
-						uv[1] = ((r.d[2]/majorAxis) + 1.0)/2.0;
-						colorC = tx->getMappedValue(uv);
-					}
-					else { //major axis is yneg (could be wrong)
-						tx = cm->getYneg();
-						uv[0] = ((r.d[0]/majorAxis) + 1.0)/2.0;
-						uv[1] = ((-r.d[2]/majorAxis) + 1.0)/2.0;
-						colorC = tx->getMappedValue(uv);
-					}
+			}
+			streamStats.nanos += (long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - start).count();
+			streamStats.rays += (long)(end - first);
+
+			for( size_t s = first; s < end; ++s ) {
+				int q = (int)(s - first);
+				const StreamRay& sr = stream[s];
+				if( packet.found & RayPacket::bit(q) ) {
+					const isect& i = packet.hit(q);
+					Material blend;
+					const Material& m = i.getMaterial(blend);
+					sampleCol[sr.sample] += sr.weight % m.shade(scene, packet[q], i);
+					if( depth > 0 )
+						spawn(packet[q], i, m, sr.weight, sr.sample, next);
 				}
+				else
+					sampleCol[sr.sample] += sr.weight % background(packet[q]);
+			}
+			first = end;
+		}
+		stream.swap(next);
+	}
+}
 
-				//major axis is z
-				else if(abs(r.d[2]) == majorAxis) {
-					if(r.d[2] < 0) { //major axis is zneg
-						tx = cm->getZpos();
-						uv[0] = ((r.d[0]/majorAxis) + 1.0)/2.0;
-						uv[1] = ((r.d[1]/majorAxis) + 1.0)/2.0;
-						colorC = tx->getMappedValue(uv);
-					}
-					else { //major axis is zpos 
-						tx = cm->getZneg();
-						uv[0] = ((-r.d[0]/majorAxis) + 1.0)/2.0;
-						uv[1] = ((r.d[1]/majorAxis) + 1.0)/2.0;
-						colorC = tx->getMappedValue(uv);
-					}
-				}
+Vec3d RayTracer::background(const ray& r)
+{
+	Vec3d colorC;
+	// No intersection.  This ray travels to infinity, so we color
+	// it according to the background color, which in this (simple) case
+	// is just black.
+	if(!traceUI->cm()) {
+		colorC = Vec3d(0.0,0.0,0.0);
+	}
+	else{
+		CubeMap* cm = getCubeMap();
+		TextureMap* tx;
+		Vec2d uv = Vec2d(0.0,0.0);
+
+		//computes max of the absolute value of the ray direction components
+		double majorAxis = fmax(fmax(abs(r.d[0]),abs(r.d[1])), abs(r.d[2]));
+
+		//major axis is x
+		if(abs(r.d[0]) == majorAxis) {
+			if(r.d[0] >= 0) { //major axis is xpos
+				tx = cm->getXpos();
+				uv[0] = (((r.d[2])/majorAxis) + 1.0)/2.0;
+				uv[1] = (((r.d[1])/majorAxis) + 1.0)/2.0;
+				colorC = tx->getMappedValue(uv);
+			}
+			else { //major axis is xneg 
+				tx = cm->getXneg();
+				uv[0] = (-(r.d[2]/majorAxis) + 1.0)/2.0;
+				uv[1] = ((r.d[1]/majorAxis) + 1.0)/2.0;
+				colorC = tx->getMappedValue(uv);
+			}
+		}
+
+		//major axis is y
+		else if(abs(r.d[1]) == majorAxis) {
+			if(r.d[1] >= 0) { //major axis is ypos
+				tx = cm->getYpos();
+				uv[0] = ((r.d[0]/majorAxis) + 1.0)/2.0;
+				uv[1] = ((r.d[2]/majorAxis) + 1.0)/2.0;
+				colorC = tx->getMappedValue(uv);
+			}
+			else { //major axis is yneg (could be wrong)
+				tx = cm->getYneg();
+				uv[0] = ((r.d[0]/majorAxis) + 1.0)/2.0;
+				uv[1] = ((-r.d[2]/majorAxis) + 1.0)/2.0;
+				colorC = tx->getMappedValue(uv);
+			}
+		}
+
+		//major axis is z
+		else if(abs(r.d[2]) == majorAxis) {
+			if(r.d[2] < 0) { //major axis is zneg
+				tx = cm->getZpos();
+				uv[0] = ((r.d[0]/majorAxis) + 1.0)/2.0;
+				uv[1] = ((r.d[1]/majorAxis) + 1.0)/2.0;
+				colorC = tx->getMappedValue(uv);
+			}
+			else { //major axis is zpos 
+				tx = cm->getZneg();
+				uv[0] = ((-r.d[0]/majorAxis) + 1.0)/2.0;
+				uv[1] = ((r.d[1]/majorAxis) + 1.0)/2.0;
+				colorC = tx->getMappedValue(uv);
 			}
 		}
 	}
@@ -227,7 +472,13 @@ Vec3d RayTracer::traceRay(ray& r, int depth)
 
 RayTracer::RayTracer()
 	: scene(0), buffer(0), buffer_width(256), buffer_height(256), m_bBufferReady(false)
-{}
+{
+	streamStats.rays = 0;
+	streamStats.packets = 0;
+	streamStats.packetRays = 0;
+	streamStats.nanos = 0;
+	allocsAtSetup = 0;
+}
 
 RayTracer::~RayTracer()
 {
@@ -288,9 +539,60 @@ bool RayTracer::loadScene( char* fn ) {
 
 	if( !sceneLoaded() ) return false;
 
+	scene->setAccelerator(traceUI->getAccelerator());
+	scene->printAcceleratorStats(cout);
+
 	return true;
 }
 
+void RayTracer::printShadowStats(std::ostream& os) const
+{
+	if (scene) scene->printShadowStats(os);
+}
+
+void RayTracer::printStreamStats(std::ostream& os) const
+{
+	long rays = streamStats.rays;
+	long packets = streamStats.packets;
+	long packetRays = streamStats.packetRays;
+	long nanos = streamStats.nanos;
+	if (!rays) return;
+	os << "secondary streams: " << rays << " rays, " << packetRays << " of them in "
+	   << packets << " packets";
+	if (packets) os << " (" << (double)packetRays / packets << " rays per packet)";
+	os << ", hits found at " << (nanos ? 1000.0 * rays / nanos : 0.0) << "M rays/s" << std::endl;
+}
+
+void RayTracer::printAllocStats(std::ostream& os) const
+{
+#ifdef RAY_COUNT_ALLOCS
+	long n = allocationCount() - allocsAtSetup;
+	long pixels = (long)buffer_width * buffer_height;
+	os << "heap allocations: " << n << " since setup, "
+	   << (pixels ? (double)n / pixels : 0.0) << " per pixel" << std::endl;
+#else
+	(void)os;
+#endif
+}
+
+void RayTracer::benchmarkTriangles(std::ostream& os) const
+{
+	if (!scene) return;
+	// instances share their mesh, so each shape is timed once
+	std::vector<const Trimesh*> seen;
+	for (std::vector<Geometry*>::const_iterator g = scene->beginObjects(); g != scene->endObjects(); ++g)
+	{
+		const Trimesh* mesh = dynamic_cast<const Trimesh*>(*g);
+		if (!mesh) continue;
+		bool dup = false;
+		for (size_t k = 0; k < seen.size() && !dup; ++k)
+			dup = mesh->isInstanceOf(*seen[k]);
+		if (dup) continue;
+		seen.push_back(mesh);
+		mesh->benchmarkTriangles(os);
+	}
+}
+
 void RayTracer::traceSetup(int w, int h)
 {
 	if (buffer_width != w || buffer_height != h)
@@ -303,5 +605,16 @@ void RayTracer::traceSetup(int w, int h)
 	}
 	memset(buffer, 0, w*h*3);
 	m_bBufferReady = true;
+
+	// pick up any change of acceleration structure made since loading
+	if (sceneLoaded()) {
+		scene->setAccelerator(traceUI->getAccelerator());
+		scene->resetShadowStats();
+	}
+	streamStats.rays = 0;
+	streamStats.packets = 0;
+	streamStats.packetRays = 0;
+	streamStats.nanos = 0;
+	allocsAtSetup = allocationCount();
 }
 
@@ -4,9 +4,13 @@
 // The main ray tracer.
 
 #include "scene/ray.h"
+#include "scene/packet.h"
 #include "scene/cubeMap.h"
 #include <time.h>
 #include <queue>
+#include <vector>
+#include <atomic>
+#include <iosfwd>
 
 class Scene;
 
@@ -17,6 +21,8 @@ public:
         ~RayTracer();
 
 	Vec3d tracePixel(int i, int j);
+	// Trace a tile of up to 8x8 pixels with packets of primary rays.
+	void traceTile(int x0, int y0, int x1, int y1);
 	Vec3d trace(double x, double y);
 	Vec3d traceRay(ray& r, int depth);
 
@@ -24,6 +30,15 @@ public:
 	double aspectRatio();
 
 	void traceSetup( int w, int h );
+	// Report each light's shadow-ray counts since the last traceSetup.
+	void printShadowStats( std::ostream& os ) const;
+	// Time packed against one-at-a-time triangle tests on each mesh.
+	void benchmarkTriangles( std::ostream& os ) const;
+	// Report the secondary-ray streams traced since the last traceSetup.
+	void printStreamStats( std::ostream& os ) const;
+	// Report heap allocations since the last traceSetup; only counted
+	// when built with -DRAY_COUNT_ALLOCS.
+	void printAllocStats( std::ostream& os ) const;
 
 	bool loadScene(char* fn);
 	bool sceneLoaded() { return scene != 0; }
@@ -38,6 +53,39 @@ public:
 
 	const Scene& getScene() { return *scene; }
 
+private:
+	static const int MAX_SAMPLES = 16;		// per pixel, with 4x4 antialiasing
+	int samplePositions(int i, int j, double* xs, double* ys) const;
+	void setPixel(int i, int j, Vec3d col);
+	Vec3d shadeHit(ray& r, const isect& i, int depth);
+	Vec3d background(const ray& r);
+
+	// Which of the reflected and refracted rays leaving i are worth tracing.
+	enum { REFLECTED = 1, REFRACTED = 2 };
+	int secondaryRays(const ray& r, const isect& i, const Material& m, ray& refl, ray& refr) const;
+
+	// A reflected or refracted ray waiting in a tile's stream.  The colour
+	// it brings back, times weight, goes to the tile's sample'th sample.
+	struct StreamRay {
+		StreamRay(const ray& rr, const Vec3d& w, int s) : r(rr), weight(w), sample(s), key(0) {}
+		ray r;
+		Vec3d weight;
+		int sample;
+		unsigned key;	// direction octant, then origin cell
+	};
+	void spawn(const ray& r, const isect& i, const Material& m, const Vec3d& weight, int sample,
+		std::vector<StreamRay>& out) const;
+	void traceStream(std::vector<StreamRay>& stream, Vec3d* sampleCol);
+
+	struct StreamStats {
+		std::atomic<long> rays;
+		std::atomic<long> packets;
+		std::atomic<long> packetRays;
+		std::atomic<long> nanos;	// finding their hits
+	};
+	StreamStats streamStats;
+	long allocsAtSetup;
+
 public:
         unsigned char *buffer;
         int buffer_width, buffer_height;
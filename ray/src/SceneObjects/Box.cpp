@@ -6,8 +6,6 @@
 
 using namespace std;
 
-const double HUGE_DOUBLE = 1e100;
-
 bool Box::intersectLocal(ray& r, isect& i) const
 {
         Vec3d p = r.getPosition();
@@ -18,7 +16,8 @@ bool Box::intersectLocal(ray& r, isect& i) const
         double x, y, t, bestT; 
         int mod0, mod1, mod2, bestIndex;
 
-        bestT = HUGE_DOUBLE;
+        // only faces inside the ray's interval can win
+        bestT = r.tmax;
         bestIndex = -1;
 
         for(it=0; it<6; it++){ 
@@ -30,7 +29,7 @@ bool Box::intersectLocal(ray& r, isect& i) const
                 
                 t = ((it/3) - 0.5 - p[mod0]) / d[mod0];                 
 
-                if(t < RAY_EPSILON || t > bestT){
+                if(t <= r.tmin || t > bestT){
                         continue;
                 }
 
@@ -77,3 +76,34 @@ bool Box::intersectLocal(ray& r, isect& i) const
 		}
         return true;
 }
+
+bool Box::occludedLocal(ray& r, double tmax) const
+{
+        Vec3d p = r.getPosition();
+        Vec3d d = r.getDirection();
+
+        // any face hit closer than tmax will do
+        for(int it=0; it<6; it++){
+                int mod0 = it%3;
+
+                if(d[mod0] == 0){
+                        continue;
+                }
+
+                double t = ((it/3) - 0.5 - p[mod0]) / d[mod0];
+
+                if(t <= r.tmin || t >= tmax){
+                        continue;
+                }
+
+                int mod1 = (it+1)%3;
+                int mod2 = (it+2)%3;
+                double x = p[mod1]+t*d[mod1];
+                double y = p[mod2]+t*d[mod2];
+
+                if(     x<=0.5 && x>=-0.5 &&
+                        y<=0.5 && y>=-0.5)
+                        return true;
+        }
+        return false;
+}
@@ -25,7 +25,7 @@ bool Cone::intersectLocal(ray& r, isect& i) const
 
 	double discriminant = b * b - 4 * a * c;
 	
-	double farRoot, nearRoot, theRoot = RAY_EPSILON;
+	double farRoot, nearRoot, theRoot = r.tmin;
 	bool farGood, nearGood;
 	
 	if(discriminant <= 0) return false;		// No intersection
@@ -45,7 +45,7 @@ bool Cone::intersectLocal(ray& r, isect& i) const
 		normal = Vec3d((r.at(theRoot))[x], (r.at(theRoot))[y], -2.0 * beta_squared * (r.at(theRoot)[z] + gamma));
 	}
 	farGood = isGoodRoot(r.at(farRoot));
-	if(farGood && ( (nearGood && farRoot < theRoot) || farRoot > RAY_EPSILON) ) 
+	if(farGood && ( (nearGood && farRoot < theRoot) || farRoot > r.tmin) ) 
 	{
 		theRoot = farRoot;
 		normal = Vec3d((r.at(theRoot))[x], (r.at(theRoot))[y], -2.0 * beta_squared * (r.at(theRoot)[z] + gamma));
@@ -66,7 +66,7 @@ bool Cone::intersectLocal(ray& r, isect& i) const
 	if(capped) {
 		if( p[0]*p[0] + p[1]*p[1] <=  b_radius*b_radius)
 		{
-			if(t1 < theRoot && t1 > RAY_EPSILON)
+			if(t1 < theRoot && t1 > r.tmin)
 			{
 				theRoot = t1;
 				if( dz > 0.0 ) {
@@ -80,7 +80,7 @@ bool Cone::intersectLocal(ray& r, isect& i) const
 		Vec3d q( r.at( t2 ) );
 		if( q[0]*q[0] + q[1]*q[1] <=  t_radius*t_radius)
 		{
-			if(t2 < theRoot && t2 > RAY_EPSILON)
+			if(t2 < theRoot && t2 > r.tmin)
 			{
 				theRoot = t2;
 				if( dz > 0.0 ) {
@@ -93,7 +93,7 @@ bool Cone::intersectLocal(ray& r, isect& i) const
 		}
 	}
 	
-	if(theRoot <= RAY_EPSILON) return false;
+	if(!r.inside(theRoot)) return false;
 	
 	i.setT(theRoot);
 	normal.normalize();
@@ -25,6 +25,15 @@ bool Cylinder::intersectLocal(ray& r, isect& i) const
 	}
 }
 
+bool Cylinder::occludedLocal(ray& r, double tmax) const
+{
+	// intersectCaps and intersectBody only fill in t and N, so no
+	// material is copied here.
+	isect i;
+	if( intersectCaps( r, i ) && i.t < tmax ) return true;
+	return intersectBody( r, i ) && i.t < tmax;
+}
+
 bool Cylinder::intersectBody( const ray& r, isect& i ) const
 {
 	double x0 = r.getPosition()[0];
@@ -53,13 +62,17 @@ bool Cylinder::intersectBody( const ray& r, isect& i ) const
 
 	double t2 = (-b + discriminant) / (2.0 * a);
 
-	if( t2 <= RAY_EPSILON ) {
+	if( t2 <= r.tmin ) {
 		return false;
 	}
 
 	double t1 = (-b - discriminant) / (2.0 * a);
 
-	if( t1 > RAY_EPSILON ) {
+	if( t1 > r.tmax ) {
+		return false;
+	}
+
+	if( t1 > r.tmin ) {
 		// Two intersections.
 		Vec3d P = r.at( t1 );
 		double z = P[2];
@@ -72,6 +85,10 @@ bool Cylinder::intersectBody( const ray& r, isect& i ) const
 		}
 	}
 
+	if( t2 > r.tmax ) {
+		return false;
+	}
+
 	Vec3d P = r.at( t2 );
 	double z = P[2];
 	if( z >= 0.0 && z <= 1.0 ) {
@@ -116,11 +133,11 @@ bool Cylinder::intersectCaps( const ray& r, isect& i ) const
 		t2 = (-pz)/dz;
 	}
 
-	if( t2 < RAY_EPSILON ) {
+	if( t2 < r.tmin || t1 > r.tmax ) {
 		return false;
 	}
 
-	if( t1 >= RAY_EPSILON ) {
+	if( t1 >= r.tmin ) {
 		Vec3d p( r.at( t1 ) );
 		if( (p[0]*p[0] + p[1]*p[1]) <= 1.0 ) {
 			i.t = t1;
@@ -134,6 +151,10 @@ bool Cylinder::intersectCaps( const ray& r, isect& i ) const
 		}
 	}
 
+	if( t2 > r.tmax ) {
+		return false;
+	}
+
 	Vec3d p( r.at( t2 ) );
 	if( (p[0]*p[0] + p[1]*p[1]) <= 1.0 ) {
 		i.t = t2;
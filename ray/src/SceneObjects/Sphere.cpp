@@ -17,17 +17,19 @@ bool Sphere::intersectLocal(ray& r, isect& i) const
 
 	discriminant = sqrt( discriminant );
 	double t2 = b + discriminant;
+	double t1 = b - discriminant;
 
-	if( t2 <= RAY_EPSILON ) {
+	if( t2 <= r.tmin || t1 > r.tmax ) {
+		return false;
+	}
+	if( t1 <= r.tmin && t2 > r.tmax ) {
 		return false;
 	}
 
 	i.obj = this;
 	i.setMaterial(this->getMaterial());
 
-	double t1 = b - discriminant;
-
-	if( t1 > RAY_EPSILON ) {
+	if( t1 > r.tmin ) {
 		i.t = t1;
 		i.N = r.at( t1 );
 		i.N.normalize();
@@ -40,3 +42,20 @@ bool Sphere::intersectLocal(ray& r, isect& i) const
 	return true;
 }
 
+bool Sphere::occludedLocal(ray& r, double tmax) const
+{
+	Vec3d v = -r.getPosition();
+	double b = v * r.getDirection();
+	double discriminant = b*b - v*v + 1;
+
+	if( discriminant < 0.0 ) {
+		return false;
+	}
+
+	discriminant = sqrt( discriminant );
+	double t1 = b - discriminant;
+	double t2 = b + discriminant;
+	double t = ( t1 > r.tmin ) ? t1 : t2;
+	return t > r.tmin && t < tmax;
+}
+
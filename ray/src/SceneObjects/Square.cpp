@@ -17,7 +17,7 @@ bool Square::intersectLocal(ray& r, isect& i) const
 
 	double t = -p[2]/d[2];
 
-	if( t <= RAY_EPSILON ) {
+	if( !r.inside( t ) ) {
 		return false;
 	}
 
@@ -43,3 +43,22 @@ bool Square::intersectLocal(ray& r, isect& i) const
     i.setUVCoordinates( Vec2d(P[0] + 0.5, P[1] + 0.5) );
 	return true;
 }
+
+bool Square::occludedLocal(ray& r, double tmax) const
+{
+	Vec3d p = r.getPosition();
+	Vec3d d = r.getDirection();
+
+	if( d[2] == 0.0 ) {
+		return false;
+	}
+
+	double t = -p[2]/d[2];
+
+	if( t <= r.tmin || t >= tmax ) {
+		return false;
+	}
+
+	Vec3d P = r.at( t );
+	return P[0] >= -0.5 && P[0] <= 0.5 && P[1] >= -0.5 && P[1] <= 0.5;
+}
@@ -13,6 +13,7 @@ public:
 	}
 
 	virtual bool intersectLocal(ray& r, isect& i ) const;
+	virtual bool occludedLocal(ray& r, double tmax) const;
 	virtual bool hasBoundingBoxCapability() const { return true; }
 
     virtual BoundingBox ComputeLocalBoundingBox()
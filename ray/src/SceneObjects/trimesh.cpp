@@ -2,48 +2,80 @@
 #include <float.h>
 #include <algorithm>
 #include <assert.h>
+#include <random>
+#include <chrono>
+#include <iostream>
 #include "trimesh.h"
 #include "../ui/TraceUI.h"
 extern TraceUI* traceUI;
 
 using namespace std;
 
-Trimesh::~Trimesh()
+TrimeshData::~TrimeshData()
 {
 	for( Materials::iterator i = materials.begin(); i != materials.end(); ++i )
 		delete *i;
+	delete bvh;
+}
+
+void TrimeshData::addTriangle( int ia, int ib, int ic )
+{
+	Vec3d a = vertex( ia );
+	Vec3d b = vertex( ib );
+	Vec3d c = vertex( ic );
+	if( (b - a).iszero() || (c - a).iszero() || (b - c).iszero() )
+		return;
+
+	Vec3d n = (b - a) ^ (c - a);
+	n.normalize();
+
+	faces.push_back( TrimeshFace( this, (int)faces.size() ) );
+	indices.push_back( ia );
+	indices.push_back( ib );
+	indices.push_back( ic );
+	faceNormals.push_back( n );
+	faceDists.push_back( n * a );
+}
+
+size_t TrimeshData::bytes() const
+{
+	return ( vertices.size() + normals.size() ) * sizeof( Vec3r ) +
+		materials.size() * ( sizeof( Material* ) + sizeof( Material ) ) +
+		indices.size() * sizeof( int ) + faceNormals.size() * sizeof( Vec3d ) +
+		faceDists.size() * sizeof( double ) + faces.size() * sizeof( TrimeshFace );
 }
 
 // must add vertices, normals, and materials IN ORDER
 void Trimesh::addVertex( const Vec3d &v )
 {
-    vertices.push_back( v );
+    mesh->vertices.push_back( Vec3r( v ) );
+    Vec3d added = mesh->vertex( (int)mesh->vertices.size() - 1 );
+    BoundingBox& bounds = mesh->localBounds;
+    bool first = bounds.isEmpty();
+    bounds.setMin( first ? added : minimum( bounds.getMin(), added ) );
+    bounds.setMax( first ? added : maximum( bounds.getMax(), added ) );
 }
 
 void Trimesh::addMaterial( Material *m )
 {
-    materials.push_back( m );
+    mesh->materials.push_back( m );
 }
 
 void Trimesh::addNormal( const Vec3d &n )
 {
-    normals.push_back( n );
+    mesh->normals.push_back( Vec3r( n ) );
 }
 
 // Returns false if the vertices a,b,c don't all exist
 bool Trimesh::addFace( int a, int b, int c )
 {
-    int vcnt = vertices.size();
+    int vcnt = mesh->vertices.size();
 
     if( a >= vcnt || b >= vcnt || c >= vcnt ) return false;
 
-    TrimeshFace *newFace = new TrimeshFace( scene, new Material(*this->material), this, a, b, c );
-    newFace->setTransform(this->transform);
-    if (!newFace->degen) faces.push_back( newFace );
-
-
-    // Don't add faces to the scene's object list so we can cull by bounding box
-    // scene->add(newFace);
+    // Faces aren't added to the scene's object list, so we can cull by
+    // bounding box.
+    mesh->addTriangle( a, b, c );
     return true;
 }
 
@@ -51,182 +83,485 @@ char* Trimesh::doubleCheck()
 // Check to make sure that if we have per-vertex materials or normals
 // they are the right number.
 {
-    if( !materials.empty() && materials.size() != vertices.size() )
+    if( !mesh->materials.empty() && mesh->materials.size() != mesh->vertices.size() )
         return "Bad Trimesh: Wrong number of materials.";
-    if( !normals.empty() && normals.size() != vertices.size() )
+    if( !mesh->normals.empty() && mesh->normals.size() != mesh->vertices.size() )
         return "Bad Trimesh: Wrong number of normals.";
 
     return 0;
 }
 
-bool Trimesh::intersectLocal(ray& r, isect& i) const
+void Trimesh::buildBVH()
 {
-	double tmin = 0.0;
-	double tmax = 0.0;
-	typedef Faces::const_iterator iter;
-	bool have_one = false;
-	for( iter j = faces.begin(); j != faces.end(); ++j )
-	  {
-	    isect cur;
-	    if( (*j)->intersectLocal( r, cur ) )
-	      {
-		if( !have_one || (cur.t < i.t) )
-		  {
-		    i = cur;
-		    have_one = true;
-		  }
-	      }
-	  }
-	if( !have_one ) i.setT(1000.0);
-	return have_one;
-}
-
-bool TrimeshFace::intersect(ray& r, isect& i) const {
-  return intersectLocal(r, i);
-}
-
-// Intersect ray r with the triangle abc.  If it hits returns true,
-// and put the parameter in t and the barycentric coordinates of the
-// intersection in u (alpha) and v (beta).
-bool TrimeshFace::intersectLocal(ray& r, isect& i) const
-{
-    Vec3d n = Vec3d();
-    Vec3d Q = Vec3d();
-    Vec3d aQ = Vec3d();
-    Vec3d bQ = Vec3d();
-    Vec3d cQ = Vec3d();
-    Vec3d bC = Vec3d();
-    Vec2d uv = Vec2d();
-    Vec3d dir = r.getDirection();
-    Vec3d p = r.getPosition();
-    double d, nP, nDir, t, aQN, bQN, cQN, denom, alpha, beta, gamma;
-    int x = 0;
-    int y = 1;
-    int z = 2;
-    Vec3d& a = parent->vertices[ids[0]];
-    const Vec3d& b = parent->vertices[ids[1]];
-    const Vec3d& c = parent->vertices[ids[2]];
-
-    // YOUR CODE HERE
-    
-    //calculating cross product of B-A and C-A
-    Vec3d b_a = b-a;
-    Vec3d c_a = c-a;
-    bC = bC.cross(b_a, c_a);
-
-    //normalized for later use with shading
-    //bC.normalize();
-
-    n = bC;
-    n.normalize();
-
-    //dot product of n and dir
-    //if this == 0, ray does not intersect plane
-    nDir = n.dot(n,dir);
-    if(nDir == 0) {
-        return false;
-    }
-
-    //dot product of n and a
-    d = n.dot(n,a);
+	std::vector<TrimeshFace*> faces( mesh->faces.size() );
+	for( size_t k = 0; k < faces.size(); ++k )
+		faces[k] = &mesh->faces[k];
+	delete mesh->bvh;
+	mesh->bvh = new BVH<TrimeshFace>( faces, LeafPacks<TrimeshFace>::LANES,
+		traceUI->getBVHWidth(), traceUI->getThreads(),
+		(BVH<TrimeshFace>::Builder)traceUI->getBVHBuild(), traceUI->getBVHQuant() );
+	scene->addMeshBVHStats( mesh->bvh->stats() );
+	scene->addMeshStats( (int)mesh->faces.size(), mesh->bytes() );
+}
 
-    //dot product of n and p
-    nP = n.dot(n,p);
+// Every mesh gets its BVH as it is loaded (buildBVH), and the leaf packs
+// there are the only triangle test.
+bool Trimesh::intersectLocal(ray& r, isect& i) const
+{
+	if( !mesh->bvh->intersect( r, i ) )
+	{
+		i.setT(1000.0);
+		return false;
+	}
+
+	// Faces are shared between instances, so the instance supplies the
+	// material unless the mesh interpolates per-vertex ones (materialAt).
+	i.obj = this;
+	if( mesh->materials.empty() ) i.setMaterial(this->getMaterial());
+	return true;
+}
 
-    t = ((d - nP)/(nDir));
+// Packets walk the mesh's BVH together.
+RayPacket::Mask Trimesh::intersectLocal(RayPacket& p, RayPacket::Mask active) const
+{
+	RayPacket::Mask won = mesh->bvh->intersect( p, active );
+	for( RayPacket::Mask m = won; m; m &= m - 1 )
+	{
+		isect& i = p.hit( RayPacket::lowestBit( m ) );
+		i.obj = this;
+		if( mesh->materials.empty() ) i.setMaterial(this->getMaterial());
+	}
+	return won;
+}
 
-    if(t <= RAY_EPSILON)
-        return false;
+// The normal (interpolated from the vertices' with smooth shading on)
+// and UVs of the closest hit, from the triangle and barycentrics it
+// recorded.
+void Trimesh::finalizeLocal( isect& i ) const
+{
+	const double alpha = i.bary[0], beta = i.bary[1], gamma = i.bary[2];
+	i.setUVCoordinates( Vec2d( alpha, beta ) ); // I think these might be the wrong uv values
+	i.setN( mesh->faceNormals[i.face] );
+	if( traceUI->smShadSw() && !mesh->normals.empty() && mesh->vertNorms )
+	{
+		const int* ids = &mesh->indices[3 * i.face];
+		Vec3d n = (Vec3d(mesh->normals[ids[0]])*alpha) + (Vec3d(mesh->normals[ids[1]])*beta) + (Vec3d(mesh->normals[ids[2]])*gamma);
+		n.normalize();
+		i.setN( n );
+	}
+}
 
-    //point of intersection
-    Q = r.at(t);
+// Per-vertex materials are blended only for the hits that get shaded.
+const Material& Trimesh::materialAt( const isect& i, Material& blend ) const
+{
+	if( mesh->materials.empty() || i.face < 0 )
+		return getMaterial();
+	const int* ids = &mesh->indices[3 * i.face];
+	blend = i.bary[0] * (*mesh->materials[ids[0]]);
+	blend += i.bary[1] * (*mesh->materials[ids[1]]);
+	blend += i.bary[2] * (*mesh->materials[ids[2]]);
+	return blend;
+}
 
-    //triangle intersection; 3 cases
-    //a-c cross q-c times n >= 0
-    Vec3d a_c = a-c;
-    Vec3d q_c = Q-c;
-    aQ = aQ.cross(a_c, q_c);
+bool Trimesh::occludedLocal(ray& r, double tmax) const
+{
+	return mesh->bvh->occluded( r, tmax );
+}
 
-    aQN = n.dot(n,aQ);
+void Trimesh::benchmarkTriangles( std::ostream& os ) const
+{
+	if( !mesh->bvh || mesh->faces.empty() ) return;
+	const LeafPacks<TrimeshFace>& packs = mesh->bvh->leafPacks();
+	const int nFaces = (int)mesh->faces.size();
+	long lanes = 0;
+	for( int p = 0; p < packs.size(); ++p ) lanes += packs.lanes( p );
+	const int nRays = (int)max( 64L, 20000000L / lanes );
+
+	// Rays from a sphere around the mesh towards random points in its box,
+	// so a fair share of them hit something.
+	Vec3d lo = mesh->localBounds.getMin(), hi = mesh->localBounds.getMax();
+	Vec3d center = (lo + hi) / 2.0;
+	double radius = (hi - lo).length();
+	std::mt19937 rng( 1 );
+	std::uniform_real_distribution<double> unit( -1.0, 1.0 );
+	std::vector<ray> rays;
+	rays.reserve( nRays );
+	while( (int)rays.size() < nRays )
+	{
+		Vec3d w( unit(rng), unit(rng), unit(rng) );
+		if( w.length() > 1.0 || w.iszero() ) continue;
+		w.normalize();
+		Vec3d target = center + prod( hi - lo, Vec3d( unit(rng), unit(rng), unit(rng) ) ) / 2.0;
+		Vec3d origin = center + w * radius;
+		Vec3d d = target - origin;
+		d.normalize();
+		rays.push_back( ray( origin, d ) );
+	}
+
+	// Every ray against every pack, in the same order both ways, so each
+	// side does the whole leaf test: lanes, nearest lane, exact distance.
+	typedef std::chrono::steady_clock clock;
+	double seconds[2];
+	long hits[2];
+	for( int simd = 0; simd < 2; ++simd )
+	{
+		hits[simd] = 0;
+		clock::time_point start = clock::now();
+		for( int k = 0; k < nRays; ++k )
+		{
+			ray r( rays[k] );
+			const LeafPacks<TrimeshFace>::RayData pr( r );
+			bool hit = false;
+			for( int p = 0; p < packs.size(); ++p )
+			{
+				isect cur;
+				if( packs.intersectPack( p, pr, r, cur, simd != 0 ) ) hit = true;
+			}
+			if( hit ) ++hits[simd];
+		}
+		seconds[simd] = std::chrono::duration<double>( clock::now() - start ).count();
+	}
+
+	double perLane = (double)lanes * nRays / seconds[0];
+	double perPack = (double)lanes * nRays / seconds[1];
+	os << "mesh of " << nFaces << " triangles in " << packs.size() << " packs, " << nRays
+	   << " rays: one lane at a time " << perLane / 1.0e6 << "M triangles/s (" << hits[0] << " hits), "
+	   << LeafPacks<TrimeshFace>::LANES << "-wide packs " << perPack / 1.0e6
+	   << "M triangles/s (" << hits[1] << " hits), " << perPack / perLane << "x" << std::endl;
+}
 
-    if(aQN < 0) {
-        return false;
-    }
+LeafPacks<TrimeshFace>::RayData::RayData( const ray& r )
+{
+	const Vec3d& p = r.getPosition();
+	const Vec3d& d = r.getDirection();
+	for( int k = 0; k < 3; ++k )
+	{
+		org[k] = p[k];
+		dir[k] = (float)d[k];
+	}
+}
 
-    //b-a cross q-a times n >= 0
-    Vec3d q_a = Q-a;
-    bQ = bQ.cross(b_a, q_a);
+void LeafPacks<TrimeshFace>::build( const std::vector<TrimeshFace*>& objs, const std::vector<int>& leafStarts )
+{
+	packs.clear();
+	packOf.assign( objs.size(), -1 );
+	mesh = objs.empty() ? 0 : objs[0]->parent;
+	for( size_t l = 0; l < leafStarts.size(); ++l )
+	{
+		int end = l + 1 < leafStarts.size() ? leafStarts[l + 1] : (int)objs.size();
+		for( int base = leafStarts[l]; base < end; base += LANES )
+		{
+			Pack pk;
+			pk.n = min( (int)LANES, end - base );
+			const TrimeshFace* first = objs[base];
+			Vec3d anchor = first->parent->vertex( (*first)[0] );
+			for( int k = 0; k < 3; ++k )
+				pk.anchor[k] = anchor[k];
+
+			double extent = 0.0;
+			for( int j = 0; j < LANES; ++j )
+			{
+				const TrimeshFace* f = objs[base + min( j, pk.n - 1 )];
+				const TrimeshData& m = *f->parent;
+				Vec3d a = m.vertex( (*f)[0] );
+				Vec3d e1 = m.vertex( (*f)[1] ) - a;
+				Vec3d e2 = m.vertex( (*f)[2] ) - a;
+				for( int k = 0; k < 3; ++k )
+				{
+					double rel = a[k] - pk.anchor[k];
+					pk.v0[k][j] = (float)rel;
+					pk.e1[k][j] = (float)e1[k];
+					pk.e2[k][j] = (float)e2[k];
+					extent = max( extent, fabs(rel) + max( fabs(e1[k]), fabs(e2[k]) ) );
+				}
+				pk.face[j] = f->index;
+			}
+			pk.extent = (float)extent;
+
+			packOf[base] = (int)packs.size();
+			packs.push_back( pk );
+		}
+	}
+}
 
-    bQN = n.dot(n,bQ);
+// The ray origin relative to the pack's anchor, and the float range of t
+// to accept.  A float t can be off by ~1e-7 of the coordinates involved,
+// so the range is widened by that much: the exact distance, taken from
+// the face's plane afterwards, decides.
+void LeafPacks<TrimeshFace>::relativeRay( const Pack& pk, const RayData& r, double tmin, double tmax,
+	float org[3], float& tlo, float& thi ) const
+{
+	static const double T_SLACK = 1.0e-5;
+
+	double o[3];
+	for( int k = 0; k < 3; ++k )
+	{
+		o[k] = r.org[k] - pk.anchor[k];
+		org[k] = (float)o[k];
+	}
+	double dlen = sqrt( (double)r.dir[0]*r.dir[0] + (double)r.dir[1]*r.dir[1] + (double)r.dir[2]*r.dir[2] );
+	double slack = T_SLACK * (max( fabs(o[0]), max( fabs(o[1]), fabs(o[2]) ) ) + pk.extent) / dlen;
+	tlo = (float)(tmin - slack);
+	thi = tmax + slack < FLT_MAX ? (float)(tmax + slack) : FLT_MAX;
+}
 
-    if(bQN < 0) {
-        return false;
-    }
+// Moller-Trumbore for every lane at once.
+// Each lane's t, u and v go in h; of the lanes that hit, the one with the
+// smallest t is found with a horizontal min and a compare.
+int LeafPacks<TrimeshFace>::testLanes( const Pack& pk, const RayData& r, double tmin, double tmax,
+	LaneHits& h, int& nearest ) const
+{
+#if defined(BVH_AVX)
+	float org[3], tlo, thi;
+	relativeRay( pk, r, tmin, tmax, org, tlo, thi );
+
+	__m256 dx = _mm256_set1_ps( r.dir[0] ), dy = _mm256_set1_ps( r.dir[1] ), dz = _mm256_set1_ps( r.dir[2] );
+	__m256 e1x = _mm256_loadu_ps( pk.e1[0] ), e1y = _mm256_loadu_ps( pk.e1[1] ), e1z = _mm256_loadu_ps( pk.e1[2] );
+	__m256 e2x = _mm256_loadu_ps( pk.e2[0] ), e2y = _mm256_loadu_ps( pk.e2[1] ), e2z = _mm256_loadu_ps( pk.e2[2] );
+
+	__m256 px = _mm256_sub_ps( _mm256_mul_ps( dy, e2z ), _mm256_mul_ps( dz, e2y ) );
+	__m256 py = _mm256_sub_ps( _mm256_mul_ps( dz, e2x ), _mm256_mul_ps( dx, e2z ) );
+	__m256 pz = _mm256_sub_ps( _mm256_mul_ps( dx, e2y ), _mm256_mul_ps( dy, e2x ) );
+	__m256 det = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( e1x, px ), _mm256_mul_ps( e1y, py ) ), _mm256_mul_ps( e1z, pz ) );
+	__m256 inv = _mm256_div_ps( _mm256_set1_ps( 1.0f ), det );
+
+	__m256 sx = _mm256_sub_ps( _mm256_set1_ps( org[0] ), _mm256_loadu_ps( pk.v0[0] ) );
+	__m256 sy = _mm256_sub_ps( _mm256_set1_ps( org[1] ), _mm256_loadu_ps( pk.v0[1] ) );
+	__m256 sz = _mm256_sub_ps( _mm256_set1_ps( org[2] ), _mm256_loadu_ps( pk.v0[2] ) );
+	__m256 u = _mm256_mul_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( sx, px ), _mm256_mul_ps( sy, py ) ), _mm256_mul_ps( sz, pz ) ), inv );
+
+	__m256 qx = _mm256_sub_ps( _mm256_mul_ps( sy, e1z ), _mm256_mul_ps( sz, e1y ) );
+	__m256 qy = _mm256_sub_ps( _mm256_mul_ps( sz, e1x ), _mm256_mul_ps( sx, e1z ) );
+	__m256 qz = _mm256_sub_ps( _mm256_mul_ps( sx, e1y ), _mm256_mul_ps( sy, e1x ) );
+	__m256 v = _mm256_mul_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( dx, qx ), _mm256_mul_ps( dy, qy ) ), _mm256_mul_ps( dz, qz ) ), inv );
+	__m256 t = _mm256_mul_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( e2x, qx ), _mm256_mul_ps( e2y, qy ) ), _mm256_mul_ps( e2z, qz ) ), inv );
+
+	__m256 zero = _mm256_setzero_ps();
+	__m256 hit = _mm256_and_ps( _mm256_cmp_ps( u, zero, _CMP_GE_OQ ), _mm256_cmp_ps( v, zero, _CMP_GE_OQ ) );
+	hit = _mm256_and_ps( hit, _mm256_cmp_ps( _mm256_add_ps( u, v ), _mm256_set1_ps( 1.0f ), _CMP_LE_OQ ) );
+	hit = _mm256_and_ps( hit, _mm256_cmp_ps( t, _mm256_set1_ps( tlo ), _CMP_GE_OQ ) );
+	hit = _mm256_and_ps( hit, _mm256_cmp_ps( t, _mm256_set1_ps( thi ), _CMP_LE_OQ ) );
+	const int used = (1 << pk.n) - 1;
+	int mask = _mm256_movemask_ps( hit ) & used;
+	if( !mask ) return 0;
+
+	_mm256_storeu_ps( h.t, t );
+	_mm256_storeu_ps( h.u, u );
+	_mm256_storeu_ps( h.v, v );
+	__m256 tm = _mm256_blendv_ps( _mm256_set1_ps( FLT_MAX ), t, hit );
+	__m256 least = _mm256_min_ps( tm, _mm256_permute2f128_ps( tm, tm, 1 ) );
+	least = _mm256_min_ps( least, _mm256_shuffle_ps( least, least, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+	least = _mm256_min_ps( least, _mm256_shuffle_ps( least, least, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+	nearest = RayPacket::lowestBit( _mm256_movemask_ps( _mm256_and_ps( hit, _mm256_cmp_ps( tm, least, _CMP_EQ_OQ ) ) ) & used );
+	return mask;
+#elif defined(BVH_SSE)
+	float org[3], tlo, thi;
+	relativeRay( pk, r, tmin, tmax, org, tlo, thi );
+
+	__m128 dx = _mm_set1_ps( r.dir[0] ), dy = _mm_set1_ps( r.dir[1] ), dz = _mm_set1_ps( r.dir[2] );
+	__m128 e1x = _mm_loadu_ps( pk.e1[0] ), e1y = _mm_loadu_ps( pk.e1[1] ), e1z = _mm_loadu_ps( pk.e1[2] );
+	__m128 e2x = _mm_loadu_ps( pk.e2[0] ), e2y = _mm_loadu_ps( pk.e2[1] ), e2z = _mm_loadu_ps( pk.e2[2] );
+
+	__m128 px = _mm_sub_ps( _mm_mul_ps( dy, e2z ), _mm_mul_ps( dz, e2y ) );
+	__m128 py = _mm_sub_ps( _mm_mul_ps( dz, e2x ), _mm_mul_ps( dx, e2z ) );
+	__m128 pz = _mm_sub_ps( _mm_mul_ps( dx, e2y ), _mm_mul_ps( dy, e2x ) );
+	__m128 det = _mm_add_ps( _mm_add_ps( _mm_mul_ps( e1x, px ), _mm_mul_ps( e1y, py ) ), _mm_mul_ps( e1z, pz ) );
+	__m128 inv = _mm_div_ps( _mm_set1_ps( 1.0f ), det );
+
+	__m128 sx = _mm_sub_ps( _mm_set1_ps( org[0] ), _mm_loadu_ps( pk.v0[0] ) );
+	__m128 sy = _mm_sub_ps( _mm_set1_ps( org[1] ), _mm_loadu_ps( pk.v0[1] ) );
+	__m128 sz = _mm_sub_ps( _mm_set1_ps( org[2] ), _mm_loadu_ps( pk.v0[2] ) );
+	__m128 u = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( sx, px ), _mm_mul_ps( sy, py ) ), _mm_mul_ps( sz, pz ) ), inv );
+
+	__m128 qx = _mm_sub_ps( _mm_mul_ps( sy, e1z ), _mm_mul_ps( sz, e1y ) );
+	__m128 qy = _mm_sub_ps( _mm_mul_ps( sz, e1x ), _mm_mul_ps( sx, e1z ) );
+	__m128 qz = _mm_sub_ps( _mm_mul_ps( sx, e1y ), _mm_mul_ps( sy, e1x ) );
+	__m128 v = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( dx, qx ), _mm_mul_ps( dy, qy ) ), _mm_mul_ps( dz, qz ) ), inv );
+	__m128 t = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( e2x, qx ), _mm_mul_ps( e2y, qy ) ), _mm_mul_ps( e2z, qz ) ), inv );
+
+	__m128 zero = _mm_setzero_ps();
+	__m128 hit = _mm_and_ps( _mm_cmpge_ps( u, zero ), _mm_cmpge_ps( v, zero ) );
+	hit = _mm_and_ps( hit, _mm_cmple_ps( _mm_add_ps( u, v ), _mm_set1_ps( 1.0f ) ) );
+	hit = _mm_and_ps( hit, _mm_cmpge_ps( t, _mm_set1_ps( tlo ) ) );
+	hit = _mm_and_ps( hit, _mm_cmple_ps( t, _mm_set1_ps( thi ) ) );
+	const int used = (1 << pk.n) - 1;
+	int mask = _mm_movemask_ps( hit ) & used;
+	if( !mask ) return 0;
+
+	_mm_storeu_ps( h.t, t );
+	_mm_storeu_ps( h.u, u );
+	_mm_storeu_ps( h.v, v );
+	__m128 tm = _mm_or_ps( _mm_and_ps( hit, t ), _mm_andnot_ps( hit, _mm_set1_ps( FLT_MAX ) ) );
+	__m128 least = _mm_min_ps( tm, _mm_shuffle_ps( tm, tm, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+	least = _mm_min_ps( least, _mm_shuffle_ps( least, least, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+	nearest = RayPacket::lowestBit( _mm_movemask_ps( _mm_and_ps( hit, _mm_cmpeq_ps( tm, least ) ) ) & used );
+	return mask;
+#else
+	return testLanesScalar( pk, r, tmin, tmax, h, nearest );
+#endif
+}
 
-    //c-b cross q-b times n >= 0
-    Vec3d c_b = c-b;
-    Vec3d q_b = Q-b;
-    cQ = cQ.cross(c_b, q_b);
+// The same one lane at a time.
+int LeafPacks<TrimeshFace>::testLanesScalar( const Pack& pk, const RayData& r, double tmin, double tmax,
+	LaneHits& h, int& nearest ) const
+{
+	float org[3], tlo, thi;
+	relativeRay( pk, r, tmin, tmax, org, tlo, thi );
+
+	int mask = 0;
+	const float dx = r.dir[0], dy = r.dir[1], dz = r.dir[2];
+	for( int j = 0; j < pk.n; ++j )
+	{
+		float e1x = pk.e1[0][j], e1y = pk.e1[1][j], e1z = pk.e1[2][j];
+		float e2x = pk.e2[0][j], e2y = pk.e2[1][j], e2z = pk.e2[2][j];
+		float px = dy*e2z - dz*e2y;
+		float py = dz*e2x - dx*e2z;
+		float pz = dx*e2y - dy*e2x;
+		float inv = 1.0f / (e1x*px + e1y*py + e1z*pz);
+		float sx = org[0] - pk.v0[0][j];
+		float sy = org[1] - pk.v0[1][j];
+		float sz = org[2] - pk.v0[2][j];
+		float u = (sx*px + sy*py + sz*pz) * inv;
+		float qx = sy*e1z - sz*e1y;
+		float qy = sz*e1x - sx*e1z;
+		float qz = sx*e1y - sy*e1x;
+		float v = (dx*qx + dy*qy + dz*qz) * inv;
+		float t = (e2x*qx + e2y*qy + e2z*qz) * inv;
+		if( u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t >= tlo && t <= thi )
+		{
+			if( !mask || t < h.t[nearest] ) nearest = j;
+			mask |= 1 << j;
+			h.t[j] = t;
+			h.u[j] = u;
+			h.v[j] = v;
+		}
+	}
+	return mask;
+}
 
-    cQN = n.dot(n,cQ);
+// The nearest lane whose exact distance is inside the ray's interval
+// wins.  Lanes rarely get that far and fail, so rather than sort them the
+// next nearest is looked for only when one does.
+bool LeafPacks<TrimeshFace>::intersectPack( int pack, const RayData& pr, ray& r, isect& i, bool simd ) const
+{
+	const Pack& pk = packs[pack];
+	LaneHits h;
+	int nearest = 0;
+	int mask = simd ? testLanes( pk, pr, r.tmin, r.tmax, h, nearest )
+		: testLanesScalar( pk, pr, r.tmin, r.tmax, h, nearest );
+	while( mask )
+	{
+		double t;
+		if( mesh->planeDistance( pk.face[nearest], r, t ) && r.inside(t) )
+		{
+			const double u = h.u[nearest], v = h.v[nearest];
+			i.setT(t);
+			i.setBary(1.0 - u - v, u, v);
+			i.face = pk.face[nearest];
+			r.tmax = t;
+			return true;
+		}
+		mask &= ~(1 << nearest);
+		for( int m = mask; m; m &= m - 1 )
+		{
+			int j = RayPacket::lowestBit( m );
+			if( j == RayPacket::lowestBit( mask ) || h.t[j] < h.t[nearest] ) nearest = j;
+		}
+	}
+	return false;
+}
 
-    if (cQN < 0) {
-        return false;
-    }
+int LeafPacks<TrimeshFace>::occluded( int first, const RayData& pr, const ray& r, double tmax ) const
+{
+	const Pack& pk = packs[packOf[first]];
+	LaneHits h;
+	int nearest = 0;
+	for( int m = testLanes( pk, pr, r.tmin, min( r.tmax, tmax ), h, nearest ); m; m &= m - 1 )
+	{
+		int j = RayPacket::lowestBit( m );
+		double t;
+		if( mesh->planeDistance( pk.face[j], r, t ) && r.inside(t) && t < tmax )
+			return j;
+	}
+	return -1;
+}
 
-    //if we reach this point, the point Q is inside the triangle,
-    //so we need to compute barycentric coords and store all useful info.
-    denom = n.dot(n,bC);
-    alpha = cQN/denom;
-    beta = aQN/denom;
-    gamma = bQN/denom;
-    uv[x] = alpha;
-    uv[y] = beta;
-    i.setUVCoordinates(uv); // I think these might be the wrong uv values
-    i.setT(t);
-    i.setBary(alpha, beta, gamma);
-    i.setN(n);
-
-    i.setMaterial(this->getMaterial());
-
-    if(!parent->materials.empty()) {
-            Material *aM = parent->materials[ids[0]];
-            Material *bM = parent->materials[ids[1]];
-            Material *cM = parent->materials[ids[2]];
-
-            Material m = (alpha*(*aM));
-            m += (beta*(*bM));
-            m += (gamma*(*cM));
-            i.setMaterial(m);
-    }
-    if(traceUI->smShadSw()){
-        if(!parent->normals.empty() && parent->vertNorms) {
-            n = (parent->normals[ids[0]]*alpha) + (parent->normals[ids[1]]*beta) + (parent->normals[ids[2]]*gamma);
-            n.normalize();
-            i.setN(n);
-        }
-    }
+BoundingBox TrimeshFace::getBoundingBox() const
+{
+	Vec3d a = parent->vertex( (*this)[0] );
+	Vec3d b = parent->vertex( (*this)[1] );
+	Vec3d c = parent->vertex( (*this)[2] );
+	BoundingBox box;
+	box.setMin( minimum( minimum( a, b ), c ) );
+	box.setMax( maximum( maximum( a, b ), c ) );
+	return box;
+}
 
-    return true;
+// Clip the triangle to the slab lo <= x[axis] <= hi one plane at a time
+// (Sutherland-Hodgman), then bound what's left and trim it to box.
+BoundingBox TrimeshFace::clippedBounds(const BoundingBox& box, int axis, double lo, double hi) const
+{
+	Vec3d poly[5], next[5];
+	int n = 3;
+	for( int k = 0; k < 3; ++k ) poly[k] = parent->vertex( (*this)[k] );
+
+	for( int side = 0; side < 2 && n > 0; ++side )
+	{
+		double plane = side ? hi : lo;
+		int m = 0;
+		for( int k = 0; k < n; ++k )
+		{
+			const Vec3d& a = poly[k];
+			const Vec3d& b = poly[(k + 1) % n];
+			bool aIn = side ? a[axis] <= plane : a[axis] >= plane;
+			bool bIn = side ? b[axis] <= plane : b[axis] >= plane;
+			if( aIn ) next[m++] = a;
+			if( aIn != bIn )
+			{
+				Vec3d p = a + (b - a) * ((plane - a[axis]) / (b[axis] - a[axis]));
+				p[axis] = plane;
+				next[m++] = p;
+			}
+		}
+		n = m;
+		for( int k = 0; k < n; ++k ) poly[k] = next[k];
+	}
+
+	BoundingBox clipped;
+	if( n == 0 ) return clipped;
+	Vec3d bmin = poly[0], bmax = poly[0];
+	for( int k = 1; k < n; ++k )
+	{
+		bmin = minimum( bmin, poly[k] );
+		bmax = maximum( bmax, poly[k] );
+	}
+	bmin = maximum( bmin, box.getMin() );
+	bmax = minimum( bmax, box.getMax() );
+	for( int k = 0; k < 3; ++k )
+		if( bmin[k] > bmax[k] ) return clipped;
+	clipped.setMin( bmin );
+	clipped.setMax( bmax );
+	return clipped;
 }
 
 void Trimesh::generateNormals()
 // Once you've loaded all the verts and faces, we can generate per
 // vertex normals by averaging the normals of the neighboring faces.
 {
-    int cnt = vertices.size();
+    Normals& normals = mesh->normals;
+    int cnt = mesh->vertices.size();
     normals.resize( cnt );
     int *numFaces = new int[ cnt ]; // the number of faces assoc. with each vertex
     memset( numFaces, 0, sizeof(int)*cnt );
     
-    for( Faces::iterator fi = faces.begin(); fi != faces.end(); ++fi )
+    for( Faces::iterator fi = mesh->faces.begin(); fi != mesh->faces.end(); ++fi )
     {
-		Vec3d faceNormal = (**fi).getNormal();
+		Vec3d faceNormal = fi->getNormal();
         
         for( int i = 0; i < 3; ++i )
         {
-            normals[(**fi)[i]] += faceNormal;
-            ++numFaces[(**fi)[i]];
+            normals[(*fi)[i]] += Vec3r( faceNormal );
+            ++numFaces[(*fi)[i]];
         }
     }
 
@@ -237,5 +572,5 @@ void Trimesh::generateNormals()
     }
 
     delete [] numFaces;
-    vertNorms = true;
+    mesh->vertNorms = true;
 }
@@ -3,42 +3,154 @@
 
 #include <list>
 #include <vector>
+#include <memory>
+#include <iosfwd>
 
 #include "../scene/ray.h"
 #include "../scene/material.h"
 #include "../scene/scene.h"
 
+class TrimeshData;
 class TrimeshFace;
+template <> class LeafPacks<TrimeshFace>;
 
-class Trimesh : public MaterialSceneObject
+// One triangle of a mesh as the BVH sees it: the mesh and the triangle's
+// number there.  Its vertices, plane and everything else live in the
+// mesh's flat arrays.  It has no ray test of its own: the BVH's leaf
+// packs test the triangles, several at a time.
+class TrimeshFace
 {
+    friend class Trimesh;
+    friend class TrimeshData;
+    friend class LeafPacks<TrimeshFace>;
+
+    const TrimeshData *parent;
+    int index;		// slot in parent's triangle arrays
+
+    TrimeshFace( const TrimeshData *parent, int index ) : parent(parent), index(index) {}
+
+public:
+    // Index of the triangle's i-th vertex in the mesh.
+    int operator[]( int i ) const;
+    Vec3d getNormal() const;
+
+    // Computed from the vertices; only the BVH build asks for it.
+    BoundingBox getBoundingBox() const;
+
+    // Bounds of the part of this triangle inside box whose coordinate on
+    // axis lies between lo and hi; used by the BVH's spatial splits.
+    BoundingBox clippedBounds(const BoundingBox& box, int axis, double lo, double hi) const;
+};
+
+inline BoundingBox clipBounds(const TrimeshFace& face, const BoundingBox& box, int axis, double lo, double hi)
+{
+    return face.clippedBounds(box, axis, lo, hi);
+}
+
+// The shape of a triangle mesh: its vertices, optional per-vertex normals
+// and materials, the triangles and the object-space BVH over them.  Every
+// Trimesh placed from the same definition shares one of these, so an
+// instanced mesh costs one copy of its geometry and one bottom-level tree
+// no matter how many times it appears in the scene.
+//
+// Triangles are kept in flat arrays indexed by triangle number rather
+// than as objects of their own; they all use the Trimesh's material
+// unless the mesh has per-vertex ones.
+class TrimeshData
+{
+    friend class Trimesh;
     friend class TrimeshFace;
-    typedef std::vector<Vec3d> Normals;
-    typedef std::vector<Vec3d> Vertices;
-    typedef std::vector<TrimeshFace*> Faces;
+    friend class LeafPacks<TrimeshFace>;
+    typedef std::vector<Vec3r> Normals;
+    typedef std::vector<Vec3r> Vertices;
+    typedef std::vector<TrimeshFace> Faces;
     typedef std::vector<Material*> Materials;
 
     Vertices vertices;
-    Faces faces;
     Normals normals;
     Materials materials;
-	BoundingBox localBounds;
+    BoundingBox localBounds;	// of the vertices; empty until one is added
+    BVH<TrimeshFace>* bvh;
+    bool vertNorms;
+
+    // Per triangle: its three vertex indices, its unit normal and plane
+    // offset (normal . first vertex) in double precision for the hit
+    // distance, and the handle the BVH is built over.  The single
+    // precision edges the hit tests run on live only in the BVH's leaf
+    // packs, in leaf order.
+    std::vector<int> indices;
+    std::vector<Vec3d> faceNormals;
+    std::vector<double> faceDists;
+    Faces faces;
+
+    // Add the triangle with vertices a, b, c, unless it's degenerate.
+    void addTriangle( int a, int b, int c );
+
+    // Distance along r to the plane of triangle f; false if r runs
+    // parallel to it.  A float distance is only good to ~1e-7 of itself,
+    // too coarse for secondary rays to clear the surface they leave.
+    bool planeDistance( int f, const ray& r, double& t ) const
+    {
+        const Vec3d& normal = faceNormals[f];
+        double nDir = normal * r.getDirection();
+        if( nDir == 0.0 )
+            return false;
+        t = (faceDists[f] - normal * r.getPosition()) / nDir;
+        return true;
+    }
+
+    // Vertex k, widened for the double precision math done with it.
+    Vec3d vertex( int k ) const { return Vec3d( vertices[k] ); }
+
+    // Memory held by the geometry: vertices, normals, materials and the
+    // triangle arrays.
+    size_t bytes() const;
+
+public:
+    TrimeshData() : bvh(0), vertNorms(false) {}
+    ~TrimeshData();
+};
+
+inline int TrimeshFace::operator[]( int i ) const
+{
+    return parent->indices[3 * index + i];
+}
+
+inline Vec3d TrimeshFace::getNormal() const
+{
+    return parent->faceNormals[index];
+}
+
+class Trimesh : public MaterialSceneObject
+{
+    typedef TrimeshData::Normals Normals;
+    typedef TrimeshData::Vertices Vertices;
+    typedef TrimeshData::Faces Faces;
+    typedef TrimeshData::Materials Materials;
+
+    std::shared_ptr<TrimeshData> mesh;
 
 public:
     Trimesh( Scene *scene, Material *mat, TransformNode *transform )
         : MaterialSceneObject(scene, mat), 
+			mesh(new TrimeshData),
 			displayListWithMaterials(0),
 			displayListWithoutMaterials(0)
     {
       this->transform = transform;
-      vertNorms = false;
     }
 
-    bool vertNorms;
-
     bool intersectLocal(ray& r, isect& i) const;
+    bool occludedLocal(ray& r, double tmax) const;
+    RayPacket::Mask intersectLocal(RayPacket& p, RayPacket::Mask active) const;
+    bool hasPacketIntersect() const { return true; }
+    void finalizeLocal( isect& i ) const;
+    const Material& materialAt( const isect& i, Material& blend ) const;
 
-    ~Trimesh();
+    // Place this mesh as another instance of the shape defined by other,
+    // sharing its vertices, faces and BVH.
+    void instanceOf( const Trimesh& other ) { mesh = other.mesh; }
+    bool isInstanceOf( const Trimesh& other ) const { return mesh == other.mesh; }
     
     // must add vertices, normals, and materials IN ORDER
     void addVertex( const Vec3d & );
@@ -50,22 +162,22 @@ public:
     
     void generateNormals();
 
+    // Once all the faces are in, sort them into a BVH in object space so
+    // intersectLocal only has to test the few triangles near the ray.
+    void buildBVH();
+
+    // Find the closest hit of a batch of random rays against every leaf
+    // pack of the BVH, with the packed SIMD test and again with the same
+    // test a lane at a time, and report triangles per second for each.
+    void benchmarkTriangles( std::ostream& os ) const;
+
     bool hasBoundingBoxCapability() const { return true; }
       
+    // Kept up to date as vertices are added, so instances sharing the
+    // mesh don't walk its vertices again.
     BoundingBox ComputeLocalBoundingBox()
     {
-        BoundingBox localbounds;
-		if (vertices.size() == 0) return localbounds;
-		localbounds.setMax(vertices[0]);
-		localbounds.setMin(vertices[0]);
-		Vertices::const_iterator viter;
-		for (viter = vertices.begin(); viter != vertices.end(); ++viter)
-	  {
-	    localbounds.setMax(maximum( localbounds.getMax(), *viter));
-	    localbounds.setMin(minimum( localbounds.getMin(), *viter));
-	  }
-		localBounds = localbounds;
-        return localbounds;
+        return mesh->localBounds;
     }
 
 protected:
@@ -74,73 +186,80 @@ protected:
 	mutable int displayListWithoutMaterials;
 };
 
-class TrimeshFace : public MaterialSceneObject
+// The BVH tests the triangles of a leaf LANES at a time.  Each leaf's
+// faces are stored in packs holding every lane's first vertex and two
+// edges, one SSE (or AVX) register per component: these packs are the
+// only copy of the single precision triangle data.  A pack test runs
+// Moller-Trumbore on all its lanes and keeps the nearest hit, checking
+// just that lane's distance against the face's double precision plane.
+template <>
+class LeafPacks<TrimeshFace>
 {
-    Trimesh *parent;
-    int ids[3];
-    Vec3d normal;
-    double dist;
-
 public:
-    TrimeshFace( Scene *scene, Material *mat, Trimesh *parent, int a, int b, int c)
-        : MaterialSceneObject( scene, mat )
-    {
-        this->parent = parent;
-        ids[0] = a;
-        ids[1] = b;
-        ids[2] = c;
-
-		// Compute the face normal here, not on the fly
-		Vec3d a_coords = parent->vertices[a];
-		Vec3d b_coords = parent->vertices[b];
-		Vec3d c_coords = parent->vertices[c];
-
-		Vec3d vab = (b_coords - a_coords);
-		Vec3d vac = (c_coords - a_coords);
-		Vec3d vcb = (b_coords - c_coords);
-        
-		if (vab.iszero() || vac.iszero() || vcb.iszero()) degen = true;
-		else {
-			degen = false;
-			normal = ((b_coords - a_coords) ^ (c_coords - a_coords));
-			normal.normalize();
-			dist = normal * a_coords;
-		}
-		localbounds = ComputeLocalBoundingBox();
-		bounds = localbounds;
-    }
+#if defined(BVH_AVX)
+    enum { LANES = 8 };
+#else
+    enum { LANES = 4 };
+#endif
 
-	BoundingBox localbounds;
-	bool degen;
+    struct RayData {
+        RayData( const ray& r );
+        double org[3];
+        float dir[3];
+    };
 
-    int operator[]( int i ) const
+    LeafPacks() : mesh(0) {}
+
+    void build( const std::vector<TrimeshFace*>& objs, const std::vector<int>& leafStarts );
+
+    bool intersect( int first, const RayData& pr, ray& r, isect& i ) const
     {
-        return ids[i];
+        return intersectPack( packOf[first], pr, r, i, true );
     }
+    int occluded( int first, const RayData& pr, const ray& r, double tmax ) const;
 
-	Vec3d getNormal()
-	{
-		return normal;
-	}
-
-    bool intersect(ray& r, isect& i ) const;
-    bool intersectLocal(ray& r, isect& i ) const;
+    // The same by pack number, with the SIMD test or one lane at a time;
+    // the benchmark compares the two.
+    bool intersectPack( int pack, const RayData& pr, ray& r, isect& i, bool simd ) const;
+    int size() const { return (int)packs.size(); }
+    int lanes( int pack ) const { return packs[pack].n; }
 
-    bool hasBoundingBoxCapability() const { return true; }
-      
-    BoundingBox ComputeLocalBoundingBox()
+    size_t bytes() const
     {
-        BoundingBox localbounds;
-        localbounds.setMax(maximum( parent->vertices[ids[0]], parent->vertices[ids[1]]));
-		localbounds.setMin(minimum( parent->vertices[ids[0]], parent->vertices[ids[1]]));
-        
-        localbounds.setMax(maximum( parent->vertices[ids[2]], localbounds.getMax()));
-		localbounds.setMin(minimum( parent->vertices[ids[2]], localbounds.getMin()));
-        return localbounds;
+        return packs.size() * sizeof(Pack) + packOf.size() * sizeof(int);
     }
 
-    const BoundingBox& getBoundingBox() const { return localbounds; }
+private:
+    // Vertices are stored relative to the first one's, which is kept in
+    // double precision, so the ray origin can be brought near the pack
+    // before anything is rounded to float.
+    struct Pack {
+        double anchor[3];
+        float extent;		// largest coordinate relative to anchor
+        int n;				// lanes in use; the rest repeat the last one
+        float v0[3][LANES];
+        float e1[3][LANES];
+        float e2[3][LANES];
+        int face[LANES];	// triangle number in the mesh
+    };
 
- };
+    // Float t, u and v for every lane of a pack.
+    struct LaneHits {
+        float t[LANES];
+        float u[LANES];
+        float v[LANES];
+    };
+
+    // Lanes of pk the ray hits with a float t roughly inside [tmin, tmax],
+    // their t, u and v in h, and in nearest the one with the smallest t.
+    int testLanes( const Pack& pk, const RayData& r, double tmin, double tmax, LaneHits& h, int& nearest ) const;
+    int testLanesScalar( const Pack& pk, const RayData& r, double tmin, double tmax, LaneHits& h, int& nearest ) const;
+    void relativeRay( const Pack& pk, const RayData& r, double tmin, double tmax,
+        float org[3], float& tlo, float& thi ) const;
+
+    const TrimeshData* mesh;
+    std::vector<Pack> packs;
+    std::vector<int> packOf;	// pack starting at each leaf primitive
+};
 
 #endif // TRIMESH_H__
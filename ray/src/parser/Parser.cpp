@@ -551,6 +551,8 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
   _tokenizer.Read( LBRACE );
 
   bool generateNormals( false );
+  bool hasGeometry( false );
+  string name;
   list<Vec3d> faces;
 
   char* error;
@@ -571,10 +573,11 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         break;
 
       case NAME:
-         parseIdentExpression();
+         name = parseIdentExpression();
          break;
 
       case MATERIALS:
+        hasGeometry = true;
         _tokenizer.Read( MATERIALS );
         _tokenizer.Read( EQUALS );
         _tokenizer.Read( LPAREN );
@@ -595,6 +598,7 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         break;
 
       case NORMALS:
+        hasGeometry = true;
         _tokenizer.Read( NORMALS );
         _tokenizer.Read( EQUALS );
         _tokenizer.Read( LPAREN );
@@ -615,6 +619,7 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         break;
 
       case FACES:
+        hasGeometry = true;
         _tokenizer.Read( FACES );
         _tokenizer.Read( EQUALS );
         _tokenizer.Read( LPAREN );
@@ -635,6 +640,7 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         break;
 
       case POLYPOINTS:
+        hasGeometry = true;
         _tokenizer.Read( POLYPOINTS );
         _tokenizer.Read( EQUALS );
         _tokenizer.Read( LPAREN );
@@ -659,6 +665,16 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
       {
         _tokenizer.Read( RBRACE );
 
+        // A named trimesh with no geometry of its own is another instance
+        // of the last trimesh defined under that name: it gets its own
+        // transform and material but shares the vertices, faces and BVH.
+        if( !hasGeometry && !name.empty() && meshes.find( name ) != meshes.end() )
+        {
+          tmesh->instanceOf( *meshes[ name ] );
+          scene->add( tmesh );
+          return;
+        }
+
         // Now add all the faces into the trimesh, since hopefully
         // the vertices have been parsed out
         for( list<Vec3d>::const_iterator vitr = faces.begin(); vitr != faces.end(); vitr++ )
@@ -678,6 +694,11 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         if( error = tmesh->doubleCheck() )
           throw ParserException( error );
 
+        tmesh->buildBVH();
+
+        if( !name.empty() )
+          meshes[ name ] = tmesh;
+
         scene->add( tmesh );
         return;
       }
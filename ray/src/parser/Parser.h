@@ -23,6 +23,7 @@
 #include "../vecmath/mat.h"
 
 typedef std::map<string,Material> mmap;
+typedef std::map<string,Trimesh*> trimap;
 
 /*
   class Parser:
@@ -105,6 +106,7 @@ private:
   private:
     Tokenizer& _tokenizer;
     mmap materials;
+    trimap meshes;	// named trimeshes, for instancing
     std::string _basePath;
 };
 
@@ -57,35 +57,24 @@ public:
 
 	// if the ray hits the box, put the "t" value of the intersection
 	// closest to the origin in tMin and the "t" value of the far intersection
-	// in tMax and return true, else return false.
-	// Using Kay/Kajiya algorithm.
+	// in tMax and return true, else return false.  Boxes lying wholly
+	// outside the ray's [tmin, tmax] interval count as misses.
+	// Kay/Kajiya slabs, without branches: the ray's cached signs pick each
+	// slab's near and far planes and its reciprocal direction scales them.
 	bool intersect(const ray& r, double& tMin, double& tMax) const {
-		Vec3d R0 = r.getPosition();
-		Vec3d Rd = r.getDirection();
 		tMin = -1.0e308; // 1.0e308 is close to infinity... close enough for us!
 		tMax = 1.0e308;
-		double ttemp;
-	
-		for (int currentaxis = 0; currentaxis < 3; currentaxis++) {
-			double vd = Rd[currentaxis];
-			// if the ray is parallel to the face's plane (=0.0)
-			if( vd == 0.0 ) continue;
-			double v1 = bmin[currentaxis] - R0[currentaxis];
-			double v2 = bmax[currentaxis] - R0[currentaxis];
-			// two slab intersections
-			double t1 = v1/vd;
-			double t2 = v2/vd;
-			if ( t1 > t2 ) { // swap t1 & t2
-				ttemp = t1;
-				t1 = t2;
-				t2 = ttemp;
-			}
-			if (t1 > tMin) tMin = t1;
-			if (t2 < tMax) tMax = t2;
-			if (tMin > tMax) return false; // box is missed
-			if (tMax < RAY_EPSILON) return false; // box is behind ray
+		for (int axis = 0; axis < 3; ++axis) {
+			double tNear = ((r.sign[axis] ? bmax : bmin)[axis] - r.p[axis]) * r.invd[axis];
+			double tFar = ((r.sign[axis] ? bmin : bmax)[axis] - r.p[axis]) * r.invd[axis];
+			// A ray running along a slab gets infinite bounds from it, or
+			// NaN if it starts on one of its planes; the comparisons are
+			// written so that NaN leaves tMin and tMax alone.
+			tMin = tNear > tMin ? tNear : tMin;
+			tMax = tFar < tMax ? tFar : tMax;
+			if (tMin > tMax) return false;
 		}
-		 return true; // it made it past all 3 axes.
+		return tMax >= r.tmin && tMin <= r.tmax;
 	}
 
 	void operator=(const BoundingBox& target) {
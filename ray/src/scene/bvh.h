@@ -0,0 +1,1882 @@
+//
+// bvh.h
+//
+// A bounding volume hierarchy over anything that can report a bounding
+// box and intersect a ray.  The tree is built top-down using the surface
+// area heuristic (SAH), evaluated over centroid bins, with large
+// subtrees handed to worker threads; it is traversed front-to-back so that subtrees lying
+// beyond the closest hit found so far are never visited.
+//
+// For near-instant builds the tree can instead be made as a linear BVH:
+// primitives are radix sorted by the 63-bit Morton code of their
+// centroid and the hierarchy falls out of the code bits, trading some
+// traversal quality for build speed.
+//
+// Or, for meshes of long thin or overlapping triangles, the SAH build
+// can also consider spatial splits (SBVH): a plane cuts straddling
+// objects into two clipped references, one per side, within a cap on
+// the total number of references.  Objects can provide
+//     BoundingBox clipBounds(const Obj& obj, const BoundingBox& box,
+//                            int axis, double lo, double hi);
+// to bound the part of them lying between lo and hi; by default only
+// the box itself is cut.
+//
+// The binary build tree can also be collapsed into a 4- or 8-wide tree
+// whose nodes keep the bounds of all their children side by side, so a
+// single SSE/AVX slab test checks every child at once.  Define
+// BVH_NO_SIMD to force the scalar slab loop for comparison.
+//
+// Wide nodes can optionally be compressed: child boxes are stored as 8-
+// or 16-bit offsets on a grid over the node's own box, rounded outward so
+// the decoded boxes always contain the real ones.  That makes nodes about
+// a third the size (8-bit) at the cost of a little looser culling, which
+// pays off for meshes whose nodes no longer fit in cache.
+//
+// Leaves can also be tested several primitives at a time by specializing
+//     template <> class LeafPacks<Obj>
+// (trimesh.h does, for triangles).  Once built, the tree hands it every
+// leaf; traversal then has it test LANES of a leaf's primitives at once,
+// returning the closest hit among them (or the first one in the way of a
+// shadow ray) just as intersect or occluded on each would.
+//
+// Packets of rays (packet.h) can walk the tree together: a node is
+// skipped for the whole packet when interval arithmetic shows none of
+// its rays can enter it, and otherwise only the rays whose own slab test
+// passes carry on below it.  At the leaves each object gets the packet's
+// live rays at once through
+//     RayPacket::Mask intersectPacket(const Obj& obj, RayPacket& p, RayPacket::Mask live);
+// which by default tries them one at a time.
+//
+// Obj must provide:
+//     const BoundingBox& getBoundingBox() const;	(or return one by value)
+//     bool intersect(ray& r, isect& i) const;
+//     bool occluded(ray& r, double tmax) const;
+// though intersect and occluded go unused, and may be left out, when
+// LeafPacks<Obj> is specialized: the packs then test every primitive.
+//
+
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <ostream>
+#include <float.h>
+#include <thread>
+#include <chrono>
+#include <stdint.h>
+#include <atomic>
+#include <cstring>
+#include <type_traits>
+
+#if !defined(BVH_NO_SIMD) && (defined(__SSE__) || defined(_M_X64) || _M_IX86_FP >= 1)
+#define BVH_SSE
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#if defined(__AVX__)
+#define BVH_AVX
+#include <immintrin.h>
+#endif
+#endif
+
+#include "ray.h"
+#include "bbox.h"
+#include "packet.h"
+
+// Running totals over one or more hierarchies, so the loader can report
+// what the acceleration structures cost.
+struct BVHStats {
+	BVHStats() : trees(0), width(2), quantBits(0), primitives(0), references(0), nodes(0),
+		bytes(0), floatBytes(0), seconds(0.0), sahCost(0.0) {}
+
+	BVHStats& operator+=(const BVHStats& s) {
+		// SAH cost is averaged over the trees, weighted by their size
+		if (primitives + s.primitives > 0)
+			sahCost = (sahCost * primitives + s.sahCost * s.primitives) /
+				(primitives + s.primitives);
+		seconds += s.seconds;
+		trees += s.trees;
+		width = std::max(width, s.width);
+		quantBits = std::max(quantBits, s.quantBits);
+		primitives += s.primitives;
+		references += s.references;
+		nodes += s.nodes;
+		bytes += s.bytes;
+		floatBytes += s.floatBytes;
+		return *this;
+	}
+
+	void print(std::ostream& os, const char* what) const {
+		if (trees == 0) return;
+		os << what << ": " << trees << (trees == 1 ? " tree, " : " trees, ")
+		   << width << "-wide, ";
+		if (quantBits) os << quantBits << "-bit bounds, ";
+		os << primitives << " primitives, ";
+		if (references != primitives) os << references << " references, ";
+		os << nodes << " nodes, "
+		   << bytes << " bytes (" << (primitives ? double(bytes) / primitives : 0.0)
+		   << " bytes/primitive), ";
+		if (floatBytes > bytes)
+			os << "saving " << floatBytes - bytes << " bytes (" << 100.0 * (floatBytes - bytes) / floatBytes
+			   << "%) over float bounds, ";
+		os << "SAH cost " << sahCost
+		   << ", built in " << seconds * 1000.0 << " ms" << std::endl;
+	}
+
+	int trees;
+	int width;
+	int quantBits;		// 8 or 16 if child bounds are quantized, else 0
+	int primitives;
+	int references;		// more than primitives when spatial splits duplicated some
+	int nodes;
+	size_t bytes;
+	size_t floatBytes;	// what the same trees would take with float bounds
+	double seconds;		// wall-clock build time
+	double sahCost;		// expected cost of a ray, in primitive tests
+};
+
+// Default for objects that can't clip themselves: just cut the box.
+template <typename Obj>
+BoundingBox clipBounds(const Obj& /*obj*/, const BoundingBox& box, int axis, double lo, double hi) {
+	Vec3d bmin = box.getMin();
+	Vec3d bmax = box.getMax();
+	bmin[axis] = std::max(bmin[axis], lo);
+	bmax[axis] = std::min(bmax[axis], hi);
+	BoundingBox b;
+	if (bmin[axis] > bmax[axis]) return b;
+	b.setMin(bmin);
+	b.setMax(bmax);
+	return b;
+}
+
+// Default for objects that can't take a packet: try each live ray in
+// turn, keeping hits closer than the ray's record.  Returns the rays
+// whose record was replaced.
+template <typename Obj>
+RayPacket::Mask intersectPacket(const Obj& obj, RayPacket& p, RayPacket::Mask live) {
+	RayPacket::Mask won = 0;
+	for (; live; live &= live - 1) {
+		int j = RayPacket::lowestBit(live);
+		isect cur;
+		if (obj.intersect(p[j], cur) && p.offer(j, cur)) won |= RayPacket::bit(j);
+	}
+	return won;
+}
+
+// No packs: every primitive of a leaf is a candidate.  A specialization
+// provides the same members, with LANES primitives per pack.
+template <typename Obj>
+class LeafPacks {
+public:
+	enum { LANES = 1 };
+
+	// Whatever the packs need of a ray, worked out once per traversal.
+	struct RayData {
+		RayData(const ray&) {}
+	};
+
+	// leafStarts holds the first primitive of every leaf, in order; the
+	// leaves partition objs.
+	void build(const std::vector<Obj*>&, const std::vector<int>&) {}
+
+	// The closest hit of r among the primitives of the pack starting at
+	// primitive first, filled in as their intersect() would and cutting
+	// r.tmax down to it.  Packs start at each leaf's first primitive and
+	// every LANES after it within the leaf.
+	bool intersect(int, const RayData&, ray&, isect&) const { return false; }
+
+	// The lane of that pack holding a primitive in the way of r before
+	// tmax, or -1.
+	int occluded(int, const RayData&, const ray&, double) const { return -1; }
+
+	size_t bytes() const { return 0; }
+};
+
+template <typename Obj>
+class BVH {
+
+public:
+	enum Builder { SAH_BUILD, MORTON_BUILD, SPATIAL_BUILD };
+
+	// branching is 2 for a binary tree, or 4 or 8 for a wide one; threads
+	// bounds how many threads may share the build.  bits is 8 or 16 to
+	// quantize the child bounds of wide nodes (a binary tree is made
+	// 4-wide for it), or 0 for float bounds.
+	BVH(const std::vector<Obj*>& objects, int leafSize = 4, int branching = 2, int threads = 1,
+		Builder how = SAH_BUILD, int bits = 0)
+		: nPrims(0), maxLeafSize(leafSize < 1 ? 1 : leafSize),
+		  width(branching == 4 || branching == 8 ? branching : 2),
+		  builder(how), quantBits(bits == 8 || bits == 16 ? bits : 0),
+		  requestedWidth(branching), requestedBits(bits),
+		  buildSeconds(0.0), sah(0.0), builtCost(0.0)
+	{
+		if (quantBits && width == 2) width = 4;
+		if (objects.empty()) return;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		std::vector<BuildRef> refs(objects.size());
+		for (size_t k = 0; k < objects.size(); ++k) {
+			refs[k].obj = objects[k];
+			refs[k].box = objects[k]->getBoundingBox();
+			refs[k].centroid = (refs[k].box.getMin() + refs[k].box.getMax()) / 2.0;
+		}
+
+		int nBuildNodes = 0;
+		if (threads < 1) threads = 1;
+		nPrims = (int)objects.size();
+		BuildNode* root;
+		if (builder == SPATIAL_BUILD) {
+			std::atomic<int> spare((int)(MAX_DUPLICATION * objects.size()));
+			BoundingBox all;
+			for (size_t k = 0; k < refs.size(); ++k) all.merge(refs[k].box);
+			root = buildSpatial(refs, area(all), 0, threads, spare, nBuildNodes);
+			gatherLeaves(root);
+		}
+		else {
+			root = (builder == MORTON_BUILD) ?
+				buildMorton(refs, threads, nBuildNodes) :
+				build(refs, 0, (int)refs.size(), 0, threads, nBuildNodes);
+			objs.reserve(refs.size());
+			for (size_t k = 0; k < refs.size(); ++k) objs.push_back(refs[k].obj);
+		}
+
+		if (width == 4) collapse(root, nodes4);
+		else if (width == 8) collapse(root, nodes8);
+		else {
+			nodes.reserve(nBuildNodes);
+			flatten(root);
+		}
+		if (quantBits) compressAll();
+		if (LANES > 1) packs.build(objs, leafStarts());
+		double rootArea = area(root->bounds);
+		sah = rootArea > 0.0 ? sahCost(root, rootArea) : intersectCost() * objs.size();
+		delete root;
+		builtCost = refitBounds(false);
+
+		buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// Find the closest intersection of r with any object in the tree.
+	bool intersect(ray& r, isect& i) const {
+		if (quantBits == 8) return width == 4 ? intersectWide(nodes4q8, r, i) : intersectWide(nodes8q8, r, i);
+		if (quantBits == 16) return width == 4 ? intersectWide(nodes4q16, r, i) : intersectWide(nodes8q16, r, i);
+		if (width == 4) return intersectWide(nodes4, r, i);
+		if (width == 8) return intersectWide(nodes8, r, i);
+		if (nodes.empty()) return false;
+
+		// objects hand r back as they got it, so these stay valid
+		const Vec3r p(r.p);
+		const Vec3r invDir(r.invd);
+		const int* sign = r.sign;
+
+		int stack[2 * MAX_DEPTH + 2];
+		int sp = 0;
+		int current = 0;
+
+		const typename LeafPacks<Obj>::RayData pr(r);
+
+		bool have_one = false;
+		for (;;) {
+			const LinearNode& node = nodes[current];
+			// Anything under a box outside the ray's interval is skipped;
+			// each hit shrinks r.tmax.
+			if (hitNode(node, p, invDir, sign, r.tmin, r.tmax)) {
+				if (node.count > 0) {
+					if (intersectLeaf(node.offset, node.offset + node.count, pr, r, i, have_one))
+						have_one = true;
+				}
+				else if (sign[node.axis]) {
+					// visit the second child first, it lies nearer along the ray
+					stack[sp++] = current + 1;
+					current = node.offset;
+					continue;
+				}
+				else {
+					stack[sp++] = node.offset;
+					current = current + 1;
+					continue;
+				}
+			}
+			if (sp == 0) break;
+			current = stack[--sp];
+		}
+		return have_one;
+	}
+
+	// Trace the rays of the packet in active (bounded with p.bound()) as
+	// intersect() would one at a time, sharing the walk down the tree.
+	// Returns the rays whose hit records were replaced.  A packet that
+	// isn't coherent is traced a ray at a time.
+	RayPacket::Mask intersect(RayPacket& p, RayPacket::Mask active) const {
+		if (!p.coherent()) {
+			RayPacket::Mask won = 0;
+			for (RayPacket::Mask m = active; m; m &= m - 1) {
+				int j = RayPacket::lowestBit(m);
+				isect cur;
+				if (intersect(p[j], cur) && p.offer(j, cur)) won |= RayPacket::bit(j);
+			}
+			return won;
+		}
+		if (quantBits == 8) return width == 4 ? intersectWide(nodes4q8, p, active) : intersectWide(nodes8q8, p, active);
+		if (quantBits == 16) return width == 4 ? intersectWide(nodes4q16, p, active) : intersectWide(nodes8q16, p, active);
+		if (width == 4) return intersectWide(nodes4, p, active);
+		if (width == 8) return intersectWide(nodes8, p, active);
+		if (nodes.empty()) return 0;
+
+		struct Entry { int node; RayPacket::Mask live; };
+		Entry stack[2 * MAX_DEPTH + 2];
+		int sp = 0;
+		stack[sp].node = 0;
+		stack[sp++].live = active;
+
+		RayPacket::Mask won = 0;
+		double tFar = p.farthest(active);
+		while (sp > 0) {
+			const Entry e = stack[--sp];
+			const LinearNode& node = nodes[e.node];
+			double lo[3], hi[3], tNear;
+			for (int axis = 0; axis < 3; ++axis) {
+				lo[axis] = node.bmin[axis];
+				hi[axis] = node.bmax[axis];
+			}
+			if (!p.mayHit(lo, hi, tFar, tNear)) continue;
+
+			// Rays are tested only until one hits: the rest of a coherent
+			// packet very likely does too, and the leaves check each ray.
+			RayPacket::Mask live = e.live;
+			for (; live; live &= live - 1) {
+				int j = RayPacket::lowestBit(live);
+				const ray& r = p[j];
+				if (hitNode(node, Vec3r(r.p), Vec3r(r.invd), r.sign, r.tmin, r.tmax)) break;
+			}
+			if (!live) continue;
+
+			if (node.count > 0) {
+				won |= intersectLeaf(node.offset, node.count, p, live);
+				tFar = p.farthest(active);
+				continue;
+			}
+			// every ray agrees which child is nearer; push that one last
+			int nearChild = p.dirNeg(node.axis) ? node.offset : e.node + 1;
+			int farChild = p.dirNeg(node.axis) ? e.node + 1 : node.offset;
+			stack[sp].node = farChild;
+			stack[sp++].live = live;
+			stack[sp].node = nearChild;
+			stack[sp++].live = live;
+		}
+		return won;
+	}
+
+	// Is there any object along r closer than tmax?  Children are visited
+	// in no particular order and the walk stops at the first hit, whose
+	// object is stored in blocker if one is given.
+	bool occluded(ray& r, double tmax, const Obj** blocker = 0) const {
+		if (quantBits == 8) return width == 4 ? occludedWide(nodes4q8, r, tmax, blocker) :
+			occludedWide(nodes8q8, r, tmax, blocker);
+		if (quantBits == 16) return width == 4 ? occludedWide(nodes4q16, r, tmax, blocker) :
+			occludedWide(nodes8q16, r, tmax, blocker);
+		if (width == 4) return occludedWide(nodes4, r, tmax, blocker);
+		if (width == 8) return occludedWide(nodes8, r, tmax, blocker);
+		if (nodes.empty()) return false;
+
+		const Vec3r p(r.p);
+		const Vec3r invDir(r.invd);
+		const int* sign = r.sign;
+
+		const typename LeafPacks<Obj>::RayData pr(r);
+
+		int stack[2 * MAX_DEPTH + 2];
+		int sp = 0;
+		int current = 0;
+		for (;;) {
+			const LinearNode& node = nodes[current];
+			if (hitNode(node, p, invDir, sign, r.tmin, tmax)) {
+				if (node.count > 0) {
+					int k = occludedLeaf(node.offset, node.offset + node.count, pr, r, tmax);
+					if (k >= 0) {
+						if (blocker) *blocker = objs[k];
+						return true;
+					}
+				}
+				else {
+					stack[sp++] = node.offset;
+					current = current + 1;
+					continue;
+				}
+			}
+			if (sp == 0) return false;
+			current = stack[--sp];
+		}
+	}
+
+	// How far refitting may push the SAH cost, as a multiple of the cost
+	// when built, before refit() asks for a rebuild.
+	static constexpr double MAX_REFIT_GROWTH = 2.0;
+
+	// Recompute every node's bounds bottom-up from the objects' current
+	// bounding boxes, keeping the topology.  The tree stays usable either
+	// way, but false means its SAH cost has grown past maxGrowth times
+	// the cost it had when built, so a rebuild is due.
+	bool refit(double maxGrowth = MAX_REFIT_GROWTH) {
+		return refitBounds(true) <= maxGrowth * builtCost;
+	}
+
+	int size() const { return (int)objs.size(); }
+	int getWidth() const { return width; }
+	Builder getBuilder() const { return builder; }
+	int getQuantBits() const { return quantBits; }
+	const LeafPacks<Obj>& leafPacks() const { return packs; }
+
+	// Was this tree built from these settings?  (They may have been
+	// adjusted: quantizing makes a binary tree 4-wide.)
+	bool builtWith(int branching, Builder how, int bits) const {
+		return requestedWidth == branching && builder == how && requestedBits == bits;
+	}
+
+	int nodeCount() const {
+		if (quantBits == 8) return (int)(width == 4 ? nodes4q8.size() : nodes8q8.size());
+		if (quantBits == 16) return (int)(width == 4 ? nodes4q16.size() : nodes8q16.size());
+		if (width == 4) return (int)nodes4.size();
+		if (width == 8) return (int)nodes8.size();
+		return (int)nodes.size();
+	}
+
+	BVHStats stats() const {
+		BVHStats s;
+		s.trees = 1;
+		s.width = width;
+		s.primitives = nPrims;
+		s.references = size();
+		s.seconds = buildSeconds;
+		s.sahCost = sah;
+		s.nodes = nodeCount();
+		s.quantBits = quantBits;
+		s.bytes = nodes.size() * sizeof(LinearNode) + nodes4.size() * sizeof(WideNode<4>) +
+			nodes8.size() * sizeof(WideNode<8>) + nodes4q8.size() * sizeof(QuantNode<4, uint8_t>) +
+			nodes8q8.size() * sizeof(QuantNode<8, uint8_t>) + nodes4q16.size() * sizeof(QuantNode<4, uint16_t>) +
+			nodes8q16.size() * sizeof(QuantNode<8, uint16_t>) + objs.size() * sizeof(Obj*) + packs.bytes();
+		s.floatBytes = s.bytes;
+		if (quantBits)
+			s.floatBytes = nodeCount() * (width == 4 ? sizeof(WideNode<4>) : sizeof(WideNode<8>)) +
+				objs.size() * sizeof(Obj*) + packs.bytes();
+		return s;
+	}
+
+private:
+	enum { LANES = LeafPacks<Obj>::LANES };
+	static const int MAX_DEPTH = 64;
+	static const int N_BINS = 32;
+	// subtrees smaller than this aren't worth a thread of their own
+	static const int PARALLEL_MIN = 4096;
+	// spatial splits may add at most this many references per primitive
+	static constexpr double MAX_DUPLICATION = 0.3;
+	// ...and are only tried where the best object split leaves children
+	// overlapping by more than this fraction of the root's area
+	static constexpr double SPATIAL_ALPHA = 1.0e-5;
+	static const float SLAB_PAD;	// relative slack on float exit distances
+	static constexpr Real NODE_PAD = sizeof(Real) < sizeof(double) ? 1.0f + 4.0f * FLT_EPSILON : 1.0;
+
+	// Relative costs of stepping through a node vs. testing a primitive,
+	// used by the surface area heuristic.
+	static double traversalCost() { return 1.0; }
+	static double intersectCost() { return 1.0; }
+
+	// Final node layout: 32 bytes, stored depth-first in one array so the
+	// first child of an interior node always directly follows it.  Bounds
+	// are floats rounded outward so the boxes stay conservative.
+	struct LinearNode {
+		float bmin[3];
+		float bmax[3];
+		int offset;				// leaf: first primitive; interior: second child
+		unsigned short count;	// primitives in a leaf, 0 for interior nodes
+		unsigned char axis;		// interior: split axis, for front-to-back order
+		unsigned char pad;
+	};
+
+	// Wide node: the boxes of up to W children in SoA layout, bmin[axis][k]
+	// for child k, so one vector load fetches an axis for all of them.
+	// Children that are leaves are stored inline by primitive range.
+	template <int W>
+	struct WideNode {
+		enum { WIDTH = W };
+		float bmin[3][W];
+		float bmax[3][W];
+		int child[W];				// interior child: node index; leaf child: first primitive
+		unsigned short count[W];	// leaf child: primitive count; 0 for interior children
+		int nChildren;
+	};
+
+	// Compressed wide node.  Child bounds are Q-bit steps of a power of
+	// two from origin along each axis, so decoding them is exact; lows
+	// are rounded down and highs up.  Interior children occupy
+	// consecutive nodes from firstChild and leaf children consecutive
+	// primitive runs from firstPrim, both in child order, so each child
+	// needs only its primitive count.
+	template <int W, typename Q>
+	struct QuantNode {
+		enum { WIDTH = W };
+		float origin[3];
+		signed char exponent[3];	// grid step along each axis is 2^exponent
+		unsigned char nChildren;
+		int firstChild;
+		int firstPrim;
+		Q qmin[3][W];
+		Q qmax[3][W];
+		unsigned char count[W];		// leaf child: primitive count; 0 for interior children
+	};
+
+	// Pointer-linked tree used only while building.
+	struct BuildNode {
+		BuildNode() : first(0), count(0), axis(0) { child[0] = child[1] = 0; }
+		~BuildNode() { delete child[0]; delete child[1]; }
+
+		BoundingBox bounds;
+		BuildNode* child[2];
+		int first;
+		int count;
+		int axis;
+		std::vector<Obj*> prims;	// spatial build: the leaf's references until gathered
+	};
+
+	struct BuildRef {
+		Obj* obj;
+		BoundingBox box;
+		Vec3d centroid;
+	};
+
+	struct CentroidLess {
+		CentroidLess(int a) : axis(a) {}
+		bool operator()(const BuildRef& a, const BuildRef& b) const
+			{ return a.centroid[axis] < b.centroid[axis]; }
+		int axis;
+	};
+
+	static double area(const BoundingBox& b) {
+		Vec3d d = b.getMax() - b.getMin();
+		return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+	}
+
+	static float roundDown(double v) {
+		float f = (float)v;
+		return (f > v) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+	}
+
+	static float roundUp(double v) {
+		float f = (float)v;
+		return (f < v) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+	}
+
+	// Slab test against a node's box, limited to the interval [tmin, tmax],
+	// without branches: the ray's sign bits pick each slab's near plane, as
+	// in BoundingBox::intersect.  A ray parallel to a slab gets infinite
+	// bounds from it, which miss unless it lies between the planes.  Done
+	// in Real; in float the exit distances are padded like the wide nodes'.
+	static bool hitNode(const LinearNode& node, const Vec3r& p, const Vec3r& invDir,
+		const int sign[3], Real tmin, Real tmax)
+	{
+		for (int axis = 0; axis < 3; ++axis) {
+			Real tNear = ((sign[axis] ? node.bmax : node.bmin)[axis] - p[axis]) * invDir[axis];
+			Real tFar = ((sign[axis] ? node.bmin : node.bmax)[axis] - p[axis]) * invDir[axis] * NODE_PAD;
+			tmin = tNear > tmin ? tNear : tmin;
+			tmax = tFar < tmax ? tFar : tmax;
+			if (tmin > tmax) return false;
+		}
+		return true;
+	}
+
+	// Which of the N_BINS centroid bins c falls in, given the low end of
+	// the centroid bounds and N_BINS / their extent.
+	static int binOf(double c, double lo, double scale) {
+		int b = (int)((c - lo) * scale);
+		return b < 0 ? 0 : (b >= N_BINS ? N_BINS - 1 : b);
+	}
+
+	static void rangeBounds(const std::vector<BuildRef>& refs, int begin, int end,
+		BoundingBox& bounds, Vec3d& cmin, Vec3d& cmax)
+	{
+		cmin = cmax = refs[begin].centroid;
+		for (int k = begin; k < end; ++k) {
+			bounds.merge(refs[k].box);
+			for (int axis = 0; axis < 3; ++axis) {
+				cmin[axis] = std::min(cmin[axis], refs[k].centroid[axis]);
+				cmax[axis] = std::max(cmax[axis], refs[k].centroid[axis]);
+			}
+		}
+	}
+
+	struct ObjectSplit {
+		double cost;		// 1e308 if the centroids can't be separated
+		int axis;
+		int bin;			// first bin of the second child
+		double lo, scale;	// bin mapping on axis
+		BoundingBox left, right;
+	};
+
+	// Drop the centroids of refs[begin, end) into equal-width bins on every
+	// axis and score the planes between bins with the SAH:
+	// cost = Ct + Ci * (A_l * N_l + A_r * N_r) / A.
+	static ObjectSplit findObjectSplit(const std::vector<BuildRef>& refs, int begin, int end,
+		const Vec3d& cmin, const Vec3d& cmax, double parentArea)
+	{
+		ObjectSplit best;
+		best.cost = 1e308;
+		best.axis = -1;
+		best.bin = 0;
+		if (!(parentArea > 0.0)) return best;
+
+		int n = end - begin;
+		for (int axis = 0; axis < 3; ++axis) {
+			double extent = cmax[axis] - cmin[axis];
+			if (!(extent > 0.0)) continue;
+			double scale = N_BINS / extent;
+
+			BoundingBox binBox[N_BINS];
+			int binCount[N_BINS] = { 0 };
+			for (int k = begin; k < end; ++k) {
+				int b = binOf(refs[k].centroid[axis], cmin[axis], scale);
+				++binCount[b];
+				binBox[b].merge(refs[k].box);
+			}
+
+			BoundingBox rightBox[N_BINS];
+			int rightCount[N_BINS];
+			BoundingBox acc;
+			int count = 0;
+			for (int b = N_BINS - 1; b > 0; --b) {
+				acc.merge(binBox[b]);
+				count += binCount[b];
+				rightBox[b] = acc;
+				rightCount[b] = count;
+			}
+
+			acc.setEmpty();
+			count = 0;
+			for (int b = 1; b < N_BINS; ++b) {
+				acc.merge(binBox[b - 1]);
+				count += binCount[b - 1];
+				if (count == 0 || count == n) continue;
+				double cost = traversalCost() + intersectCost() *
+					(area(acc) * count + area(rightBox[b]) * rightCount[b]) / parentArea;
+				if (cost < best.cost) {
+					best.cost = cost;
+					best.axis = axis;
+					best.bin = b;
+					best.lo = cmin[axis];
+					best.scale = scale;
+					best.left = acc;
+					best.right = rightBox[b];
+				}
+			}
+		}
+		return best;
+	}
+
+	// Move the refs in [begin, end) on the first child's side of split to
+	// the front; returns where the second child starts.
+	static int partitionObjects(std::vector<BuildRef>& refs, int begin, int end,
+		const ObjectSplit& split)
+	{
+		int axis = split.axis, bin = split.bin;
+		double lo = split.lo, scale = split.scale;
+		return (int)(std::partition(refs.begin() + begin, refs.begin() + end,
+			[=](const BuildRef& ref) { return binOf(ref.centroid[axis], lo, scale) < bin; })
+			- refs.begin());
+	}
+
+	// When the centroids all coincide, halve along the widest centroid axis.
+	static int medianSplit(std::vector<BuildRef>& refs, int begin, int end,
+		const Vec3d& cmin, const Vec3d& cmax, int& axis)
+	{
+		axis = 0;
+		for (int a = 1; a < 3; ++a)
+			if (cmax[a] - cmin[a] > cmax[axis] - cmin[axis]) axis = a;
+		int mid = begin + (end - begin) / 2;
+		std::nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end,
+			CentroidLess(axis));
+		return mid;
+	}
+
+	BuildNode* build(std::vector<BuildRef>& refs, int begin, int end, int depth,
+		int threads, int& nBuildNodes)
+	{
+		BuildNode* node = new BuildNode();
+		++nBuildNodes;
+
+		Vec3d cmin, cmax;
+		rangeBounds(refs, begin, end, node->bounds, cmin, cmax);
+
+		int n = end - begin;
+		node->first = begin;
+		node->count = n;
+		if (n <= 1 || depth >= MAX_DEPTH) return node;
+
+		ObjectSplit split = findObjectSplit(refs, begin, end, cmin, cmax, area(node->bounds));
+
+		// Splitting isn't worth it (or can't separate the centroids): make a
+		// leaf, unless there are too many objects to leave in one.
+		double leafCost = intersectCost() * n;
+		int mid;
+		int axis = split.axis;
+		if (split.axis < 0) {
+			if (n <= maxLeafSize) return node;
+			mid = medianSplit(refs, begin, end, cmin, cmax, axis);
+		}
+		else if (split.cost >= leafCost && n <= maxLeafSize) return node;
+		else mid = partitionObjects(refs, begin, end, split);
+
+		node->count = 0;
+		node->axis = axis;
+		if (threads > 1 && n >= PARALLEL_MIN) {
+			// Build the first child on a new thread, splitting the thread
+			// budget between the two halves.
+			int half = threads / 2;
+			int leftNodes = 0;
+			std::thread worker([&]() {
+				node->child[0] = build(refs, begin, mid, depth + 1, half, leftNodes);
+			});
+			node->child[1] = build(refs, mid, end, depth + 1, threads - half, nBuildNodes);
+			worker.join();
+			nBuildNodes += leftNodes;
+		}
+		else {
+			node->child[0] = build(refs, begin, mid, depth + 1, 1, nBuildNodes);
+			node->child[1] = build(refs, mid, end, depth + 1, 1, nBuildNodes);
+		}
+		return node;
+	}
+
+	struct SpatialSplit {
+		SpatialSplit() : cost(1e308), axis(-1), plane(0.0) {}
+		double cost;		// 1e308 if none
+		int axis;
+		double plane;
+	};
+
+	// Bin the node's own bounds (not the centroids) on every axis.  Each
+	// reference is clipped to every bin it spans; it enters the count of
+	// its first bin and leaves from its last, so a plane's left count is
+	// the entries before it and its right count the exits after it.
+	static SpatialSplit findSpatialSplit(const std::vector<BuildRef>& refs,
+		const BoundingBox& bounds, double parentArea)
+	{
+		SpatialSplit best;
+
+		const int n = (int)refs.size();
+		for (int axis = 0; axis < 3; ++axis) {
+			double lo = bounds.getMin()[axis];
+			double extent = bounds.getMax()[axis] - lo;
+			if (!(extent > 0.0)) continue;
+			double scale = N_BINS / extent;
+			double binWidth = extent / N_BINS;
+
+			BoundingBox binBox[N_BINS];
+			int enter[N_BINS] = { 0 };
+			int leave[N_BINS] = { 0 };
+			for (int k = 0; k < n; ++k) {
+				const BuildRef& ref = refs[k];
+				int b0 = binOf(ref.box.getMin()[axis], lo, scale);
+				int b1 = binOf(ref.box.getMax()[axis], lo, scale);
+				++enter[b0];
+				++leave[b1];
+				if (b0 == b1) binBox[b0].merge(ref.box);
+				else for (int b = b0; b <= b1; ++b)
+					binBox[b].merge(clipBounds(*ref.obj, ref.box, axis,
+						lo + b * binWidth, lo + (b + 1) * binWidth));
+			}
+
+			BoundingBox rightBox[N_BINS];
+			int rightCount[N_BINS];
+			BoundingBox acc;
+			int count = 0;
+			for (int b = N_BINS - 1; b > 0; --b) {
+				acc.merge(binBox[b]);
+				count += leave[b];
+				rightBox[b] = acc;
+				rightCount[b] = count;
+			}
+
+			acc.setEmpty();
+			count = 0;
+			for (int b = 1; b < N_BINS; ++b) {
+				acc.merge(binBox[b - 1]);
+				count += enter[b - 1];
+				if (count == 0 || rightCount[b] == 0) continue;
+				double cost = traversalCost() + intersectCost() *
+					(area(acc) * count + area(rightBox[b]) * rightCount[b]) / parentArea;
+				if (cost < best.cost) {
+					best.cost = cost;
+					best.axis = axis;
+					best.plane = lo + b * binWidth;
+				}
+			}
+		}
+		return best;
+	}
+
+	static void addRef(std::vector<BuildRef>& side, const BuildRef& ref, const BoundingBox& part) {
+		BoundingBox box = part;
+		if (box.isEmpty()) return;
+		BuildRef r;
+		r.obj = ref.obj;
+		r.box = box;
+		r.centroid = (box.getMin() + box.getMax()) / 2.0;
+		side.push_back(r);
+	}
+
+	// SAH build that weighs a spatial split against the best object split
+	// at every node.  Each node owns its references, since a spatial split
+	// can send one reference to both sides; the leaves are gathered into
+	// objs once the tree is done.
+	BuildNode* buildSpatial(std::vector<BuildRef>& refs, double rootArea, int depth,
+		int threads, std::atomic<int>& spare, int& nBuildNodes)
+	{
+		BuildNode* node = new BuildNode();
+		++nBuildNodes;
+
+		const int n = (int)refs.size();
+		Vec3d cmin, cmax;
+		rangeBounds(refs, 0, n, node->bounds, cmin, cmax);
+
+		node->count = n;
+		if (n <= 1 || depth >= MAX_DEPTH) return spatialLeaf(node, refs);
+
+		double parentArea = area(node->bounds);
+		ObjectSplit split = findObjectSplit(refs, 0, n, cmin, cmax, parentArea);
+
+		SpatialSplit spatial;
+		if (parentArea > 0.0) {
+			bool overlapping = split.axis < 0;
+			if (!overlapping) {
+				// surface area of the intersection of the two child boxes
+				Vec3d lo = split.left.getMin(), hi = split.left.getMax();
+				Vec3d rlo = split.right.getMin(), rhi = split.right.getMax();
+				double d[3];
+				overlapping = true;
+				for (int axis = 0; axis < 3; ++axis) {
+					d[axis] = std::min(hi[axis], rhi[axis]) - std::max(lo[axis], rlo[axis]);
+					if (d[axis] < 0.0) overlapping = false;
+				}
+				overlapping = overlapping &&
+					2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]) > SPATIAL_ALPHA * rootArea;
+			}
+			if (overlapping) spatial = findSpatialSplit(refs, node->bounds, parentArea);
+		}
+
+		double leafCost = intersectCost() * n;
+		std::vector<BuildRef> left, right;
+		int axis = split.axis;
+
+		if (spatial.cost < split.cost && (spatial.cost < leafCost || n > maxLeafSize)) {
+			// Count the references the plane cuts and claim that many from
+			// the duplication budget before committing to the split.
+			int straddling = 0;
+			for (int k = 0; k < n; ++k)
+				if (refs[k].box.getMin()[spatial.axis] < spatial.plane &&
+					refs[k].box.getMax()[spatial.axis] > spatial.plane) ++straddling;
+			int have = spare.load();
+			while (have >= straddling && !spare.compare_exchange_weak(have, have - straddling)) {}
+
+			if (have >= straddling) {
+				axis = spatial.axis;
+				for (int k = 0; k < n; ++k) {
+					const BuildRef& ref = refs[k];
+					double bmin = ref.box.getMin()[axis];
+					double bmax = ref.box.getMax()[axis];
+					if (bmax <= spatial.plane) left.push_back(ref);
+					else if (bmin >= spatial.plane) right.push_back(ref);
+					else {
+						addRef(left, ref, clipBounds(*ref.obj, ref.box, axis, bmin, spatial.plane));
+						addRef(right, ref, clipBounds(*ref.obj, ref.box, axis, spatial.plane, bmax));
+					}
+				}
+				// clipping can leave a side empty; fall back to objects then
+				if (left.empty() || right.empty()) {
+					left.clear();
+					right.clear();
+				}
+			}
+		}
+
+		if (left.empty()) {
+			int mid;
+			axis = split.axis;
+			if (split.axis < 0) {
+				if (n <= maxLeafSize) return spatialLeaf(node, refs);
+				mid = medianSplit(refs, 0, n, cmin, cmax, axis);
+			}
+			else if (split.cost >= leafCost && n <= maxLeafSize) return spatialLeaf(node, refs);
+			else mid = partitionObjects(refs, 0, n, split);
+			left.assign(refs.begin(), refs.begin() + mid);
+			right.assign(refs.begin() + mid, refs.end());
+		}
+		std::vector<BuildRef>().swap(refs);
+
+		node->count = 0;
+		node->axis = axis;
+		if (threads > 1 && n >= PARALLEL_MIN) {
+			int half = threads / 2;
+			int leftNodes = 0;
+			std::thread worker([&]() {
+				node->child[0] = buildSpatial(left, rootArea, depth + 1, half, spare, leftNodes);
+			});
+			node->child[1] = buildSpatial(right, rootArea, depth + 1, threads - half, spare, nBuildNodes);
+			worker.join();
+			nBuildNodes += leftNodes;
+		}
+		else {
+			node->child[0] = buildSpatial(left, rootArea, depth + 1, 1, spare, nBuildNodes);
+			node->child[1] = buildSpatial(right, rootArea, depth + 1, 1, spare, nBuildNodes);
+		}
+		return node;
+	}
+
+	static BuildNode* spatialLeaf(BuildNode* node, const std::vector<BuildRef>& refs) {
+		for (size_t k = 0; k < refs.size(); ++k) node->prims.push_back(refs[k].obj);
+		return node;
+	}
+
+	void gatherLeaves(BuildNode* node) {
+		if (node->child[0]) {
+			gatherLeaves(node->child[0]);
+			gatherLeaves(node->child[1]);
+			return;
+		}
+		node->first = (int)objs.size();
+		node->count = (int)node->prims.size();
+		objs.insert(objs.end(), node->prims.begin(), node->prims.end());
+		std::vector<Obj*>().swap(node->prims);
+	}
+
+	// Spread x's low 21 bits out to every third bit of a 64-bit word.
+	static uint64_t spreadBits(uint64_t x) {
+		x &= 0x1fffff;
+		x = (x | x << 32) & 0x1f00000000ffffULL;
+		x = (x | x << 16) & 0x1f0000ff0000ffULL;
+		x = (x | x << 8) & 0x100f00f00f00f00fULL;
+		x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+		x = (x | x << 2) & 0x1249249249249249ULL;
+		return x;
+	}
+
+	struct MortonRef {
+		uint64_t code;
+		int index;
+	};
+
+	// Run body(t) for t = 0 .. threads-1, each on its own thread.
+	template <typename Body>
+	static void parallelFor(int threads, const Body& body) {
+		std::vector<std::thread> workers;
+		for (int t = 1; t < threads; ++t) workers.push_back(std::thread(body, t));
+		body(0);
+		for (size_t t = 0; t < workers.size(); ++t) workers[t].join();
+	}
+
+	// Stable LSD radix sort on the codes, 8 bits a pass.  Every thread
+	// histograms and then scatters its own contiguous slice; passes where
+	// all codes share a digit are skipped.
+	static void radixSort(std::vector<MortonRef>& v, int threads) {
+		const int n = (int)v.size();
+		if (n < 2 * PARALLEL_MIN) threads = 1;
+		std::vector<MortonRef> tmp(n);
+		std::vector<int> offsets(threads * 256);
+
+		for (int shift = 0; shift < 64; shift += 8) {
+			std::fill(offsets.begin(), offsets.end(), 0);
+			parallelFor(threads, [&](int t) {
+				int* count = &offsets[t * 256];
+				for (int k = n * (long long)t / threads; k < n * (long long)(t + 1) / threads; ++k)
+					++count[(v[k].code >> shift) & 255];
+			});
+
+			int first = (v[0].code >> shift) & 255;
+			int same = 0;
+			for (int t = 0; t < threads; ++t) same += offsets[t * 256 + first];
+			if (same == n) continue;
+
+			int sum = 0;
+			for (int digit = 0; digit < 256; ++digit) {
+				for (int t = 0; t < threads; ++t) {
+					int c = offsets[t * 256 + digit];
+					offsets[t * 256 + digit] = sum;
+					sum += c;
+				}
+			}
+
+			parallelFor(threads, [&](int t) {
+				int* next = &offsets[t * 256];
+				for (int k = n * (long long)t / threads; k < n * (long long)(t + 1) / threads; ++k)
+					tmp[next[(v[k].code >> shift) & 255]++] = v[k];
+			});
+			v.swap(tmp);
+		}
+	}
+
+	// Linear BVH: quantize the centroids to a 2^21 grid over their bounds,
+	// sort by Morton code and split each range where its highest differing
+	// code bit flips.
+	BuildNode* buildMorton(std::vector<BuildRef>& refs, int threads, int& nBuildNodes) {
+		const int n = (int)refs.size();
+		Vec3d cmin = refs[0].centroid;
+		Vec3d cmax = cmin;
+		for (int k = 1; k < n; ++k) {
+			for (int axis = 0; axis < 3; ++axis) {
+				cmin[axis] = std::min(cmin[axis], refs[k].centroid[axis]);
+				cmax[axis] = std::max(cmax[axis], refs[k].centroid[axis]);
+			}
+		}
+		Vec3d scale;
+		for (int axis = 0; axis < 3; ++axis) {
+			double extent = cmax[axis] - cmin[axis];
+			scale[axis] = extent > 0.0 ? ((1 << 21) - 1) / extent : 0.0;
+		}
+
+		std::vector<MortonRef> sorted(n);
+		for (int k = 0; k < n; ++k) {
+			uint64_t q[3];
+			for (int axis = 0; axis < 3; ++axis)
+				q[axis] = (uint64_t)((refs[k].centroid[axis] - cmin[axis]) * scale[axis]);
+			// x takes the highest bit of each triple, so bit % 3 == 2 splits in x
+			sorted[k].code = spreadBits(q[0]) << 2 | spreadBits(q[1]) << 1 | spreadBits(q[2]);
+			sorted[k].index = k;
+		}
+		radixSort(sorted, threads);
+
+		std::vector<BuildRef> ordered(n);
+		std::vector<uint64_t> codes(n);
+		for (int k = 0; k < n; ++k) {
+			ordered[k] = refs[sorted[k].index];
+			codes[k] = sorted[k].code;
+		}
+		refs.swap(ordered);
+
+		return emitMorton(refs, codes, 0, n, 62, 0, threads, nBuildNodes);
+	}
+
+	BuildNode* emitMorton(const std::vector<BuildRef>& refs, const std::vector<uint64_t>& codes,
+		int begin, int end, int bit, int depth, int threads, int& nBuildNodes)
+	{
+		BuildNode* node = new BuildNode();
+		++nBuildNodes;
+
+		int n = end - begin;
+		node->first = begin;
+		node->count = n;
+		if (n <= maxLeafSize || depth >= MAX_DEPTH) {
+			for (int k = begin; k < end; ++k) node->bounds.merge(refs[k].box);
+			return node;
+		}
+
+		// The codes in [begin, end) are sorted and agree above bit, so the
+		// first one with the highest differing bit set starts the second half.
+		uint64_t diff = codes[begin] ^ codes[end - 1];
+		while (bit >= 0 && !((diff >> bit) & 1)) --bit;
+		int mid;
+		if (bit < 0) mid = begin + n / 2;		// identical codes: just halve
+		else {
+			uint64_t key = (codes[begin] >> bit | 1) << bit;
+			mid = (int)(std::lower_bound(codes.begin() + begin, codes.begin() + end, key) - codes.begin());
+		}
+
+		node->count = 0;
+		node->axis = bit < 0 ? 0 : 2 - bit % 3;
+		if (threads > 1 && n >= PARALLEL_MIN) {
+			int half = threads / 2;
+			int leftNodes = 0;
+			std::thread worker([&]() {
+				node->child[0] = emitMorton(refs, codes, begin, mid, bit - 1, depth + 1, half, leftNodes);
+			});
+			node->child[1] = emitMorton(refs, codes, mid, end, bit - 1, depth + 1, threads - half, nBuildNodes);
+			worker.join();
+			nBuildNodes += leftNodes;
+		}
+		else {
+			node->child[0] = emitMorton(refs, codes, begin, mid, bit - 1, depth + 1, 1, nBuildNodes);
+			node->child[1] = emitMorton(refs, codes, mid, end, bit - 1, depth + 1, 1, nBuildNodes);
+		}
+		node->bounds = node->child[0]->bounds;
+		node->bounds.merge(node->child[1]->bounds);
+		return node;
+	}
+
+	BoundingBox leafBounds(int first, int count) const {
+		BoundingBox box;
+		for (int k = first; k < first + count; ++k) box.merge(objs[k]->getBoundingBox());
+		return box;
+	}
+
+	static void storeBounds(const BoundingBox& box, float bmin[3], float bmax[3], int stride) {
+		Vec3d lo = box.getMin();
+		Vec3d hi = box.getMax();
+		for (int axis = 0; axis < 3; ++axis) {
+			bmin[axis * stride] = roundDown(lo[axis]);
+			bmax[axis * stride] = roundUp(hi[axis]);
+		}
+	}
+
+	// Children are always stored after their parent, so walking the node
+	// array backwards visits them first.  Returns the SAH cost of the
+	// flattened tree with bounds taken from the whole objects; those
+	// bounds replace the stored ones only if store is set, which would
+	// undo the clipping of a spatial-split build.
+	double refitBounds(bool store) {
+		if (quantBits == 8) return width == 4 ? refitQuantized(nodes4q8, store) : refitQuantized(nodes8q8, store);
+		if (quantBits == 16) return width == 4 ? refitQuantized(nodes4q16, store) : refitQuantized(nodes8q16, store);
+		const int n = nodeCount();
+		if (n == 0) return 0.0;
+		std::vector<BoundingBox> box(n);
+		double cost = 0.0;
+
+		for (int i = n - 1; i >= 0; --i) {
+			if (width == 2) {
+				LinearNode& node = nodes[i];
+				if (node.count > 0) box[i] = leafBounds(node.offset, node.count);
+				else {
+					box[i] = box[i + 1];
+					box[i].merge(box[node.offset]);
+				}
+				if (store) storeBounds(box[i], node.bmin, node.bmax, 1);
+				cost += area(box[i]) * (node.count > 0 ? intersectCost() * node.count : traversalCost());
+				continue;
+			}
+			for (int k = 0; k < width; ++k) {
+				int child, count, nChildren;
+				float* bmin;
+				float* bmax;
+				if (width == 4) {
+					WideNode<4>& node = nodes4[i];
+					child = node.child[k]; count = node.count[k]; nChildren = node.nChildren;
+					bmin = &node.bmin[0][k]; bmax = &node.bmax[0][k];
+				}
+				else {
+					WideNode<8>& node = nodes8[i];
+					child = node.child[k]; count = node.count[k]; nChildren = node.nChildren;
+					bmin = &node.bmin[0][k]; bmax = &node.bmax[0][k];
+				}
+				if (k >= nChildren) break;
+
+				if (count > 0) {
+					BoundingBox leaf = leafBounds(child, count);
+					cost += area(leaf) * intersectCost() * count;
+					if (store) storeBounds(leaf, bmin, bmax, width);
+					box[i].merge(leaf);
+				}
+				else {
+					if (store) storeBounds(box[child], bmin, bmax, width);
+					box[i].merge(box[child]);
+				}
+			}
+			cost += area(box[i]) * traversalCost();
+		}
+
+		double rootArea = area(box[0]);
+		return rootArea > 0.0 ? cost / rootArea : intersectCost() * objs.size();
+	}
+
+	// Expected cost of tracing a ray through the finished tree, in units
+	// of primitive tests, taking each node's hit probability to be its
+	// area relative to the root.
+	static double sahCost(const BuildNode* node, double rootArea) {
+		double p = area(node->bounds) / rootArea;
+		if (!node->child[0]) return p * intersectCost() * node->count;
+		return p * traversalCost() + sahCost(node->child[0], rootArea) +
+			sahCost(node->child[1], rootArea);
+	}
+
+	// Lay the build tree out depth-first; returns the index of node.
+	int flatten(const BuildNode* node) {
+		int self = (int)nodes.size();
+		nodes.push_back(LinearNode());
+
+		LinearNode& linear = nodes[self];
+		Vec3d bmin = node->bounds.getMin();
+		Vec3d bmax = node->bounds.getMax();
+		for (int axis = 0; axis < 3; ++axis) {
+			linear.bmin[axis] = roundDown(bmin[axis]);
+			linear.bmax[axis] = roundUp(bmax[axis]);
+		}
+		linear.axis = (unsigned char)node->axis;
+		linear.pad = 0;
+
+		if (!node->child[0]) {
+			linear.offset = node->first;
+			linear.count = (unsigned short)node->count;
+		}
+		else {
+			linear.count = 0;
+			flatten(node->child[0]);
+			int second = flatten(node->child[1]);
+			nodes[self].offset = second;
+		}
+		return self;
+	}
+
+	// Collapse the binary build tree into W-wide nodes: keep opening the
+	// interior child with the largest surface area until the node has W
+	// children or only leaves are left.  Returns the index of the node.
+	template <int W>
+	int collapse(const BuildNode* node, std::vector< WideNode<W> >& out) {
+		const BuildNode* kids[W];
+		int n = 0;
+		if (!node->child[0]) kids[n++] = node;		// the whole tree is one leaf
+		else {
+			kids[n++] = node->child[0];
+			kids[n++] = node->child[1];
+			while (n < W) {
+				int best = -1;
+				double bestArea = -1.0;
+				for (int k = 0; k < n; ++k) {
+					if (kids[k]->child[0] && area(kids[k]->bounds) > bestArea) {
+						bestArea = area(kids[k]->bounds);
+						best = k;
+					}
+				}
+				if (best < 0) break;
+				const BuildNode* opened = kids[best];
+				kids[best] = opened->child[0];
+				kids[n++] = opened->child[1];
+			}
+		}
+
+		int self = (int)out.size();
+		out.push_back(WideNode<W>());
+		WideNode<W>& wide = out[self];
+		wide.nChildren = n;
+		for (int k = 0; k < W; ++k) {
+			Vec3d bmin, bmax;
+			if (k < n) {
+				bmin = kids[k]->bounds.getMin();
+				bmax = kids[k]->bounds.getMax();
+			}
+			for (int axis = 0; axis < 3; ++axis) {
+				wide.bmin[axis][k] = roundDown(bmin[axis]);
+				wide.bmax[axis][k] = roundUp(bmax[axis]);
+			}
+			wide.child[k] = 0;
+			wide.count[k] = 0;
+		}
+
+		for (int k = 0; k < n; ++k) {
+			if (!kids[k]->child[0]) {
+				out[self].child[k] = kids[k]->first;
+				out[self].count[k] = (unsigned short)kids[k]->count;
+			}
+			else {
+				int c = collapse(kids[k], out);
+				out[self].child[k] = c;
+			}
+		}
+		return self;
+	}
+
+	// Slab test of the ray against all children of a wide node.  near[]
+	// and far[] pick bmin or bmax per axis by the sign of the direction,
+	// so no min/max swap is needed.  Returns a bit mask of the children
+	// hit no farther than tmax and stores their entry distances in tNear.
+#ifdef BVH_SSE
+	static int slab4(const float* const nearB[3], const float* const farB[3], int base,
+		const float org[3], const float inv[3], float tmax, float* tNear)
+	{
+		__m128 t0 = _mm_setzero_ps();
+		__m128 t1 = _mm_set1_ps(tmax);
+		for (int axis = 0; axis < 3; ++axis) {
+			__m128 o = _mm_set1_ps(org[axis]);
+			__m128 id = _mm_set1_ps(inv[axis]);
+			t0 = _mm_max_ps(t0, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearB[axis] + base), o), id));
+			t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farB[axis] + base), o), id));
+		}
+		// widen the exit distance to absorb the float rounding above
+		t1 = _mm_mul_ps(t1, _mm_set1_ps(SLAB_PAD));
+		_mm_storeu_ps(tNear + base, t0);
+		return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+	}
+#endif
+
+	template <int W>
+	static int slabTest(const WideNode<W>& node, const bool dirNeg[3],
+		const float org[3], const float inv[3], float tmax, float* tNear)
+	{
+		const float* nearB[3];
+		const float* farB[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			nearB[axis] = dirNeg[axis] ? node.bmax[axis] : node.bmin[axis];
+			farB[axis] = dirNeg[axis] ? node.bmin[axis] : node.bmax[axis];
+		}
+
+#if defined(BVH_AVX)
+		if (W == 8) {
+			__m256 t0 = _mm256_setzero_ps();
+			__m256 t1 = _mm256_set1_ps(tmax);
+			for (int axis = 0; axis < 3; ++axis) {
+				__m256 o = _mm256_set1_ps(org[axis]);
+				__m256 id = _mm256_set1_ps(inv[axis]);
+				t0 = _mm256_max_ps(t0, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearB[axis]), o), id));
+				t1 = _mm256_min_ps(t1, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farB[axis]), o), id));
+			}
+			t1 = _mm256_mul_ps(t1, _mm256_set1_ps(SLAB_PAD));
+			_mm256_storeu_ps(tNear, t0);
+			return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+		}
+#endif
+#if defined(BVH_SSE)
+		int mask = 0;
+		for (int base = 0; base < W; base += 4)
+			mask |= slab4(nearB, farB, base, org, inv, tmax, tNear) << base;
+		return mask;
+#else
+		int mask = 0;
+		for (int k = 0; k < W; ++k) {
+			float t0 = 0.0f, t1 = tmax;
+			for (int axis = 0; axis < 3; ++axis) {
+				t0 = std::max(t0, (nearB[axis][k] - org[axis]) * inv[axis]);
+				t1 = std::min(t1, (farB[axis][k] - org[axis]) * inv[axis]);
+			}
+			tNear[k] = t0;
+			if (t0 <= t1 * SLAB_PAD) mask |= 1 << k;
+		}
+		return mask;
+#endif
+	}
+
+	// Float wide nodes are tested as stored; compressed ones are decoded
+	// into the same layout first.
+	template <int W>
+	static const WideNode<W>& expand(const WideNode<W>& node, WideNode<W>&) { return node; }
+
+	template <int W, typename Q>
+	static const WideNode<W>& expand(const QuantNode<W, Q>& node, WideNode<W>& out) {
+		for (int axis = 0; axis < 3; ++axis) {
+			float o = node.origin[axis];
+			float step = gridStep(node.exponent[axis]);
+#ifdef BVH_SSE
+			// four children at a time, rounding exactly as dequantize() does
+			__m128 vo = _mm_set1_ps(o);
+			__m128 vs = _mm_set1_ps(step);
+			for (int k = 0; k < W; k += 4) {
+				_mm_storeu_ps(&out.bmin[axis][k], _mm_add_ps(vo, _mm_mul_ps(widen4(&node.qmin[axis][k]), vs)));
+				_mm_storeu_ps(&out.bmax[axis][k], _mm_add_ps(vo, _mm_mul_ps(widen4(&node.qmax[axis][k]), vs)));
+			}
+#else
+			for (int k = 0; k < W; ++k) {
+				out.bmin[axis][k] = dequantize(o, node.qmin[axis][k], step);
+				out.bmax[axis][k] = dequantize(o, node.qmax[axis][k], step);
+			}
+#endif
+		}
+		int nextChild = node.firstChild;
+		int nextPrim = node.firstPrim;
+		for (int k = 0; k < node.nChildren; ++k) {
+			out.count[k] = node.count[k];
+			if (node.count[k]) {
+				out.child[k] = nextPrim;
+				nextPrim += node.count[k];
+			}
+			else out.child[k] = nextChild++;
+		}
+		out.nChildren = node.nChildren;
+		return out;
+	}
+
+#ifdef BVH_SSE
+	// Four unsigned grid coordinates as floats.
+	static __m128 widen4(const uint8_t* q) {
+		int32_t v;
+		std::memcpy(&v, q, sizeof(v));
+		__m128i zero = _mm_setzero_si128();
+		__m128i x = _mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero);
+		return _mm_cvtepi32_ps(_mm_unpacklo_epi16(x, zero));
+	}
+	static __m128 widen4(const uint16_t* q) {
+		__m128i x = _mm_loadl_epi64((const __m128i*)q);
+		return _mm_cvtepi32_ps(_mm_unpacklo_epi16(x, _mm_setzero_si128()));
+	}
+#endif
+
+	// 2^e as a float, built from its bits; e stays within the normal range.
+	static float gridStep(int e) {
+		uint32_t bits = (uint32_t)(e + 127) << 23;
+		float f;
+		std::memcpy(&f, &bits, sizeof(f));
+		return f;
+	}
+
+	// The same expression encodes and decodes, so the rounding checks in
+	// quantize() hold for traversal too.  (q * step is exact.)
+	static float dequantize(float origin, int q, float step) { return origin + (float)q * step; }
+
+	// Fill in node's grid and child bounds from the children's boxes.
+	template <int W, typename Q>
+	static void quantize(QuantNode<W, Q>& node, BoundingBox box[W]) {
+		const int QMAX = (int)std::numeric_limits<Q>::max();
+		BoundingBox all;
+		for (int k = 0; k < node.nChildren; ++k)
+			if (!box[k].isEmpty()) all.merge(box[k]);
+		Vec3d lo = all.getMin();
+		Vec3d hi = all.getMax();
+
+		for (int axis = 0; axis < 3; ++axis) {
+			float o = roundDown(lo[axis]);
+			int e = -126;
+			double need = (hi[axis] - o) / QMAX;
+			if (need > 0.0) std::frexp(need, &e);
+			e = std::max(-126, std::min(e, 127));
+			while (e < 127 && dequantize(o, QMAX, gridStep(e)) < hi[axis]) ++e;
+			node.origin[axis] = o;
+			node.exponent[axis] = (signed char)e;
+
+			float step = gridStep(e);
+			for (int k = 0; k < W; ++k) {
+				if (k >= node.nChildren || box[k].isEmpty()) {
+					// an inside-out box, which no ray can hit
+					node.qmin[axis][k] = (Q)QMAX;
+					node.qmax[axis][k] = 0;
+					continue;
+				}
+				double clo = box[k].getMin()[axis];
+				double chi = box[k].getMax()[axis];
+				int a = (int)std::max(0.0, std::min((double)QMAX, std::floor((clo - o) / step)));
+				int b = (int)std::max(0.0, std::min((double)QMAX, std::ceil((chi - o) / step)));
+				while (a > 0 && dequantize(o, a, step) > clo) --a;
+				while (b < QMAX && dequantize(o, b, step) < chi) ++b;
+				node.qmin[axis][k] = (Q)a;
+				node.qmax[axis][k] = (Q)b;
+			}
+		}
+	}
+
+	// Replace the float wide nodes with compressed ones.  Leaves of more
+	// than 255 primitives don't fit the count field; such trees keep
+	// float bounds.
+	void compressAll() {
+		bool ok;
+		if (quantBits == 8) ok = width == 4 ? compress(nodes4, nodes4q8) : compress(nodes8, nodes8q8);
+		else ok = width == 4 ? compress(nodes4, nodes4q16) : compress(nodes8, nodes8q16);
+		if (!ok) {
+			quantBits = 0;
+			return;
+		}
+		std::vector< WideNode<4> >().swap(nodes4);
+		std::vector< WideNode<8> >().swap(nodes8);
+	}
+
+	template <int W, typename Q>
+	bool compress(const std::vector< WideNode<W> >& wn, std::vector< QuantNode<W, Q> >& out) {
+		if (wn.empty()) return true;
+		for (size_t i = 0; i < wn.size(); ++i)
+			for (int k = 0; k < wn[i].nChildren; ++k)
+				if (wn[i].count[k] > 255) return false;
+
+		// Primitives are reordered so each node's leaf children are
+		// contiguous.
+		std::vector<Obj*> order;
+		order.reserve(objs.size());
+		out.reserve(wn.size());
+		out.resize(1);
+		compressNode(wn, 0, out, 0, order);
+		objs.swap(order);
+		return true;
+	}
+
+	template <int W, typename Q>
+	void compressNode(const std::vector< WideNode<W> >& wn, int src,
+		std::vector< QuantNode<W, Q> >& out, int self, std::vector<Obj*>& order)
+	{
+		const WideNode<W>& node = wn[src];
+		int first = (int)out.size();
+		BoundingBox box[W];
+		for (int k = 0; k < node.nChildren; ++k) {
+			box[k].setMin(Vec3d(node.bmin[0][k], node.bmin[1][k], node.bmin[2][k]));
+			box[k].setMax(Vec3d(node.bmax[0][k], node.bmax[1][k], node.bmax[2][k]));
+			if (node.count[k] == 0) out.push_back(QuantNode<W, Q>());
+		}
+
+		QuantNode<W, Q>& q = out[self];
+		q.nChildren = (unsigned char)node.nChildren;
+		q.firstChild = first;
+		q.firstPrim = (int)order.size();
+		for (int k = 0; k < W; ++k) {
+			q.count[k] = (k < node.nChildren) ? (unsigned char)node.count[k] : 0;
+			if (q.count[k])
+				order.insert(order.end(), objs.begin() + node.child[k],
+					objs.begin() + node.child[k] + node.count[k]);
+		}
+		quantize(q, box);
+
+		int next = first;
+		for (int k = 0; k < node.nChildren; ++k)
+			if (node.count[k] == 0) compressNode(wn, node.child[k], out, next++, order);
+	}
+
+	// refitBounds() for compressed nodes: children follow their parent,
+	// so walking backwards visits them first.
+	template <int W, typename Q>
+	double refitQuantized(std::vector< QuantNode<W, Q> >& qn, bool store) {
+		const int n = (int)qn.size();
+		if (n == 0) return 0.0;
+		std::vector<BoundingBox> box(n);
+		double cost = 0.0;
+
+		for (int i = n - 1; i >= 0; --i) {
+			QuantNode<W, Q>& node = qn[i];
+			BoundingBox kid[W];
+			int nextChild = node.firstChild;
+			int nextPrim = node.firstPrim;
+			for (int k = 0; k < node.nChildren; ++k) {
+				if (node.count[k]) {
+					kid[k] = leafBounds(nextPrim, node.count[k]);
+					cost += area(kid[k]) * intersectCost() * node.count[k];
+					nextPrim += node.count[k];
+				}
+				else kid[k] = box[nextChild++];
+				box[i].merge(kid[k]);
+			}
+			cost += area(box[i]) * traversalCost();
+			if (store) quantize(node, kid);
+		}
+
+		double rootArea = area(box[0]);
+		return rootArea > 0.0 ? cost / rootArea : intersectCost() * objs.size();
+	}
+
+	template <typename Node>
+	bool intersectWide(const std::vector<Node>& wn, ray& r, isect& i) const {
+		enum { W = Node::WIDTH };
+		if (wn.empty()) return false;
+
+		const Vec3d p = r.getPosition();
+		float org[3], inv[3];
+		bool dirNeg[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			org[axis] = (float)p[axis];
+			// keep 1/d finite so a zero component can't produce 0 * inf
+			double id = r.invd[axis];
+			if (id > 1.0e30) id = 1.0e30;
+			else if (id < -1.0e30) id = -1.0e30;
+			inv[axis] = (float)id;
+			dirNeg[axis] = r.sign[axis] != 0;
+		}
+
+		// A stack entry is either a wide node (count == 0) or a leaf's
+		// primitive range, with the distance at which the ray enters it.
+		struct Entry { int index; int count; float t; };
+		Entry stack[W * (MAX_DEPTH + 1)];
+		int sp = 0;
+		stack[sp].index = 0;
+		stack[sp].count = 0;
+		stack[sp++].t = 0.0f;
+
+		const typename LeafPacks<Obj>::RayData pr(r);
+		bool have_one = false;
+		float tmax = r.tmax < FLT_MAX ? roundUp(r.tmax) : FLT_MAX;
+		while (sp > 0) {
+			const Entry e = stack[--sp];
+			if (e.t > tmax * SLAB_PAD) continue;
+
+			if (e.count > 0) {
+				if (intersectLeaf(e.index, e.index + e.count, pr, r, i, have_one)) {
+					have_one = true;
+					tmax = roundUp(i.t);
+				}
+				continue;
+			}
+
+			WideNode<W> decoded;
+			const WideNode<W>& node = expand(wn[e.index], decoded);
+			float tNear[W];
+			int mask = slabTest(node, dirNeg, org, inv, tmax, tNear) & ((1 << node.nChildren) - 1);
+
+			// Push the children hit farthest first so the nearest is popped next.
+			int order[W];
+			int n = 0;
+			for (; mask; mask &= mask - 1) {
+				int k = 0;
+				while (!(mask & (1 << k))) ++k;
+				int j = n++;
+				while (j > 0 && tNear[order[j - 1]] < tNear[k]) {
+					order[j] = order[j - 1];
+					--j;
+				}
+				order[j] = k;
+			}
+			for (int j = 0; j < n; ++j) {
+				int k = order[j];
+				stack[sp].index = node.child[k];
+				stack[sp].count = node.count[k];
+				stack[sp++].t = tNear[k];
+			}
+		}
+		return have_one;
+	}
+
+	template <typename Node>
+	RayPacket::Mask intersectWide(const std::vector<Node>& wn, RayPacket& p, RayPacket::Mask active) const {
+		enum { W = Node::WIDTH };
+		if (wn.empty()) return 0;
+
+		// Each ray's float origin and inverse direction for slabTest();
+		// the signs are common to the packet.
+		float org[RayPacket::MAX][3], inv[RayPacket::MAX][3];
+		bool dirNeg[3];
+		for (int axis = 0; axis < 3; ++axis) dirNeg[axis] = p.dirNeg(axis);
+		for (RayPacket::Mask m = active; m; m &= m - 1) {
+			int j = RayPacket::lowestBit(m);
+			for (int axis = 0; axis < 3; ++axis) {
+				org[j][axis] = (float)p[j].p[axis];
+				double id = p[j].invd[axis];
+				if (id > 1.0e30) id = 1.0e30;
+				else if (id < -1.0e30) id = -1.0e30;
+				inv[j][axis] = (float)id;
+			}
+		}
+
+		// Like intersectWide() for one ray, with the rays still live.
+		struct Entry { int index; int count; RayPacket::Mask live; };
+		Entry stack[W * (MAX_DEPTH + 1)];
+		int sp = 0;
+		stack[sp].index = 0;
+		stack[sp].count = 0;
+		stack[sp++].live = active;
+
+		RayPacket::Mask won = 0;
+		double tFar = p.farthest(active);
+		while (sp > 0) {
+			const Entry e = stack[--sp];
+			if (e.count > 0) {
+				won |= intersectLeaf(e.index, e.count, p, e.live);
+				tFar = p.farthest(active);
+				continue;
+			}
+
+			WideNode<W> decoded;
+			const WideNode<W>& node = expand(wn[e.index], decoded);
+
+			// children the packet as a whole might reach
+			int reach = 0;
+			double tNear[W];
+			for (int k = 0; k < node.nChildren; ++k) {
+				double lo[3], hi[3];
+				for (int axis = 0; axis < 3; ++axis) {
+					lo[axis] = node.bmin[axis][k];
+					hi[axis] = node.bmax[axis][k];
+				}
+				if (p.mayHit(lo, hi, tFar, tNear[k])) reach |= 1 << k;
+			}
+			if (!reach) continue;
+
+			// ...and for each of them, the rays from the first that really
+			// enters it on, as in the binary walk.
+			RayPacket::Mask live[W];
+			for (int k = 0; k < W; ++k) live[k] = 0;
+			for (RayPacket::Mask m = e.live; m && reach; m &= m - 1) {
+				int j = RayPacket::lowestBit(m);
+				float t[W];
+				float tmax = p[j].tmax < FLT_MAX ? roundUp(p[j].tmax) : FLT_MAX;
+				int hit = slabTest(node, dirNeg, org[j], inv[j], tmax, t) & reach;
+				for (reach &= ~hit; hit; hit &= hit - 1)
+					live[lowestBit(hit)] = m;
+			}
+
+			// Push the farthest first so the nearest is popped next.
+			int order[W];
+			int n = 0;
+			for (int k = 0; k < node.nChildren; ++k) {
+				if (!live[k]) continue;
+				int j = n++;
+				while (j > 0 && tNear[order[j - 1]] < tNear[k]) {
+					order[j] = order[j - 1];
+					--j;
+				}
+				order[j] = k;
+			}
+			for (int j = 0; j < n; ++j) {
+				int k = order[j];
+				stack[sp].index = node.child[k];
+				stack[sp].count = node.count[k];
+				stack[sp++].live = live[k];
+			}
+		}
+		return won;
+	}
+
+	// The rays in live against the leaf [first, first + count), some of
+	// which may miss its box.  Packed
+	// primitives are tested a ray at a time, a pack of them at once;
+	// otherwise each object takes all the rays together.
+	RayPacket::Mask intersectLeaf(int first, int count, RayPacket& p, RayPacket::Mask live) const {
+		return intersectLeaf(first, first + count, p, live, Packed());
+	}
+
+	RayPacket::Mask intersectLeaf(int first, int end, RayPacket& p, RayPacket::Mask live, std::true_type) const {
+		RayPacket::Mask won = 0;
+		for (RayPacket::Mask m = live; m; m &= m - 1) {
+			int j = RayPacket::lowestBit(m);
+			ray& r = p[j];
+			const typename LeafPacks<Obj>::RayData pr(r);
+			isect cur;
+			if (intersectLeaf(first, end, pr, r, cur, false) && p.offer(j, cur))
+				won |= RayPacket::bit(j);
+		}
+		return won;
+	}
+
+	RayPacket::Mask intersectLeaf(int first, int end, RayPacket& p, RayPacket::Mask live, std::false_type) const {
+		RayPacket::Mask won = 0;
+		for (int k = first; k < end; ++k)
+			won |= intersectPacket(*objs[k], p, live);
+		return won;
+	}
+
+	template <typename Node>
+	bool occludedWide(const std::vector<Node>& wn, ray& r, double tmax, const Obj** blocker) const {
+		enum { W = Node::WIDTH };
+		if (wn.empty()) return false;
+
+		const Vec3d p = r.getPosition();
+		float org[3], inv[3];
+		bool dirNeg[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			org[axis] = (float)p[axis];
+			double id = r.invd[axis];
+			if (id > 1.0e30) id = 1.0e30;
+			else if (id < -1.0e30) id = -1.0e30;
+			inv[axis] = (float)id;
+			dirNeg[axis] = r.sign[axis] != 0;
+		}
+		float limit = tmax < FLT_MAX ? roundUp(tmax) : FLT_MAX;
+		const typename LeafPacks<Obj>::RayData pr(r);
+
+		int stack[W * (MAX_DEPTH + 1)];
+		int sp = 0;
+		stack[sp++] = 0;
+		while (sp > 0) {
+			WideNode<W> decoded;
+			const WideNode<W>& node = expand(wn[stack[--sp]], decoded);
+			float tNear[W];
+			int mask = slabTest(node, dirNeg, org, inv, limit, tNear) & ((1 << node.nChildren) - 1);
+			for (; mask; mask &= mask - 1) {
+				int k = 0;
+				while (!(mask & (1 << k))) ++k;
+				if (node.count[k] == 0) {
+					stack[sp++] = node.child[k];
+					continue;
+				}
+				int j = occludedLeaf(node.child[k], node.child[k] + node.count[k], pr, r, tmax);
+				if (j >= 0) {
+					if (blocker) *blocker = objs[j];
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	// The primitives [first, end) of a leaf against r, as intersect() on
+	// each would test them: the closest hit, if it beats the one already
+	// in i (when have_one), goes in i and r.tmax comes down to it.  With
+	// packs, LANES primitives are tested at once.
+	bool intersectLeaf(int first, int end, const typename LeafPacks<Obj>::RayData& pr,
+		ray& r, isect& i, bool have_one) const
+	{
+		bool found = false;
+		for (int k = first; k < end; k += LANES) {
+			isect cur;
+			if (intersectGroup(k, pr, r, cur, Packed()) && (!(have_one || found) || cur.t < i.t)) {
+				i = cur;
+				found = true;
+			}
+		}
+		return found;
+	}
+
+	// The first primitive of the leaf [first, end) found in the way of r
+	// before tmax, or -1.
+	int occludedLeaf(int first, int end, const typename LeafPacks<Obj>::RayData& pr,
+		ray& r, double tmax) const
+	{
+		for (int k = first; k < end; k += LANES) {
+			int j = occludedGroup(k, pr, r, tmax, Packed());
+			if (j >= 0) return j;
+		}
+		return -1;
+	}
+
+	// One pack starting at primitive k, or the primitive itself without
+	// packs.  Only the overload that is called gets instantiated, so with
+	// packs Obj needn't have intersect or occluded of its own.
+	typedef std::integral_constant<bool, (LeafPacks<Obj>::LANES > 1)> Packed;
+
+	bool intersectGroup(int k, const typename LeafPacks<Obj>::RayData& pr, ray& r, isect& i, std::true_type) const {
+		return packs.intersect(k, pr, r, i);
+	}
+	bool intersectGroup(int k, const typename LeafPacks<Obj>::RayData&, ray& r, isect& i, std::false_type) const {
+		return objs[k]->intersect(r, i);
+	}
+
+	int occludedGroup(int k, const typename LeafPacks<Obj>::RayData& pr, ray& r, double tmax, std::true_type) const {
+		int lane = packs.occluded(k, pr, r, tmax);
+		return lane >= 0 ? k + lane : -1;
+	}
+	int occludedGroup(int k, const typename LeafPacks<Obj>::RayData&, ray& r, double tmax, std::false_type) const {
+		return objs[k]->occluded(r, tmax) ? k : -1;
+	}
+
+	static int lowestBit(int mask) {
+		int k = 0;
+		while (!(mask & (1 << k))) ++k;
+		return k;
+	}
+
+	// First primitive of every leaf, in order, from whichever layout the
+	// tree ended up in.
+	std::vector<int> leafStarts() const {
+		std::vector<int> starts;
+		for (size_t i = 0; i < nodes.size(); ++i)
+			if (nodes[i].count > 0) starts.push_back(nodes[i].offset);
+		wideLeafStarts(nodes4, starts);
+		wideLeafStarts(nodes8, starts);
+		wideLeafStarts(nodes4q8, starts);
+		wideLeafStarts(nodes8q8, starts);
+		wideLeafStarts(nodes4q16, starts);
+		wideLeafStarts(nodes8q16, starts);
+		std::sort(starts.begin(), starts.end());
+		return starts;
+	}
+
+	template <typename Node>
+	static void wideLeafStarts(const std::vector<Node>& wn, std::vector<int>& starts) {
+		enum { W = Node::WIDTH };
+		for (size_t i = 0; i < wn.size(); ++i) {
+			WideNode<W> decoded;
+			const WideNode<W>& node = expand(wn[i], decoded);
+			for (int k = 0; k < node.nChildren; ++k)
+				if (node.count[k] > 0) starts.push_back(node.child[k]);
+		}
+	}
+
+	std::vector<Obj*> objs;
+	LeafPacks<Obj> packs;
+	std::vector<LinearNode> nodes;
+	std::vector< WideNode<4> > nodes4;
+	std::vector< WideNode<8> > nodes8;
+	std::vector< QuantNode<4, uint8_t> > nodes4q8;
+	std::vector< QuantNode<8, uint8_t> > nodes8q8;
+	std::vector< QuantNode<4, uint16_t> > nodes4q16;
+	std::vector< QuantNode<8, uint16_t> > nodes8q16;
+	int nPrims;
+	int maxLeafSize;
+	int width;
+	Builder builder;
+	int quantBits;
+	int requestedWidth;		// as passed in, for builtWith()
+	int requestedBits;
+	double buildSeconds;
+	double sah;
+	double builtCost;		// SAH cost of the flattened tree as built, for refit()
+};
+
+template <typename Obj>
+const float BVH<Obj>::SLAB_PAD = 1.0f + 4.0f * FLT_EPSILON;
+
+#endif // __BVH_H__
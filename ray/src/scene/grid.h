@@ -0,0 +1,320 @@
+//
+// grid.h
+//
+// A two-level uniform grid over anything that can report a bounding box
+// and intersect a ray.  The top level divides the given bounds into
+// roughly cubic cells, about three per cube root of the object count;
+// cells that still hold many objects get a grid of their own.  Rays walk
+// the cells in order with a 3D-DDA and stop at the first cell that
+// contains the closest hit found so far; shadow queries stop at the first
+// hit of any kind.  Objects spanning several cells are mailboxed, so each
+// is tested at most once per ray.
+//
+// Obj must provide:
+//     const BoundingBox& getBoundingBox() const;
+//     bool intersect(ray& r, isect& i) const;
+//     bool occluded(ray& r, double tmax) const;
+//
+
+#ifndef __GRID_H__
+#define __GRID_H__
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "ray.h"
+#include "bbox.h"
+
+template <typename Obj>
+class Grid {
+
+public:
+	Grid(const std::vector<Obj*>& objects, const BoundingBox& bounds)
+		: objs(objects)
+	{
+		if (objs.empty()) return;
+
+		std::vector<int> all(objs.size());
+		for (size_t k = 0; k < objs.size(); ++k) all[k] = (int)k;
+
+		levels.push_back(Level());
+		fill(0, bounds, all, DENSITY, true);
+	}
+
+	// Find the closest intersection of r with any object in the grid.
+	bool intersect(ray& r, isect& i) const {
+		if (levels.empty()) return false;
+
+		double tmin, tmax;
+		if (!levels[0].bounds.intersect(r, tmin, tmax)) return false;
+
+		Closest visit(objs, r, i);
+		walk(levels[0], r, std::max(tmin, 0.0), std::min(tmax, r.tmax), visit, mailbox());
+		return visit.have_one;
+	}
+
+	// Is there any object along r closer than limit?  The walk ends at
+	// limit, or at the end of the first cell with a hit; the object hit
+	// goes in blocker if one is given.
+	bool occluded(ray& r, double limit, const Obj** blocker = 0) const {
+		if (levels.empty()) return false;
+
+		double tmin, tmax;
+		if (!levels[0].bounds.intersect(r, tmin, tmax) || tmin >= limit) return false;
+
+		AnyHit visit(objs, r, limit);
+		walk(levels[0], r, std::max(tmin, 0.0), std::min(tmax, limit), visit, mailbox());
+		if (visit.hit && blocker) *blocker = visit.blocker;
+		return visit.hit;
+	}
+
+	int cellCount() const {
+		int n = 0;
+		for (size_t k = 0; k < levels.size(); ++k) n += (int)levels[k].cells.size();
+		return n;
+	}
+	int subgridCount() const { return levels.empty() ? 0 : (int)levels.size() - 1; }
+	int referenceCount() const {
+		int n = 0;
+		for (size_t k = 0; k < levels.size(); ++k) n += (int)levels[k].items.size();
+		return n;
+	}
+	const int* resolution() const { return levels.empty() ? 0 : levels[0].res; }
+	// Memory held by the cells and their object lists.
+	size_t bytes() const {
+		size_t n = objs.size() * sizeof(Obj*);
+		for (size_t k = 0; k < levels.size(); ++k)
+			n += sizeof(Level) + (levels[k].cells.size() + levels[k].items.size() + levels[k].sub.size()) * sizeof(int);
+		return n;
+	}
+
+private:
+	// top-level cells per cube root of the object count, and the same for
+	// the grids inside crowded cells
+	static const int DENSITY = 3;
+	static const int SUB_DENSITY = 2;
+	static const int MAX_RES = 64;
+	// cells with more objects than this get a grid of their own
+	static const int SUBGRID_MIN = 8;
+
+	// One grid.  Cell c holds items[cells[c] .. cells[c + 1]) as indices
+	// into objs; a top-level cell with a grid of its own instead has its
+	// level index in sub[c] (0 means none, since level 0 is the top).
+	struct Level {
+		BoundingBox bounds;
+		int res[3];
+		Vec3d cellSize;
+		Vec3d invCellSize;
+		std::vector<int> cells;		// per cell: first entry in items, plus an end marker
+		std::vector<int> items;
+		std::vector<int> sub;
+	};
+
+	// What walk() does with the objects in each cell: keep the closest
+	// hit, or just note that there was one.
+	struct Closest {
+		Closest(const std::vector<Obj*>& o, ray& ray_, isect& i_) : objs(o), r(ray_), i(i_), have_one(false) {}
+		void visit(int k) {
+			isect cur;
+			if (objs[k]->intersect(r, cur) && (!have_one || cur.t < i.t)) {
+				i = cur;
+				have_one = true;
+			}
+		}
+		// Anything closer would have been in this cell or an earlier one.
+		bool done(double exit) const { return have_one && i.t <= exit; }
+
+		const std::vector<Obj*>& objs;
+		ray& r;
+		isect& i;
+		bool have_one;
+	};
+
+	struct AnyHit {
+		AnyHit(const std::vector<Obj*>& o, ray& ray_, double t) : objs(o), r(ray_), tmax(t), hit(false), blocker(0) {}
+		void visit(int k) {
+			if (!hit && objs[k]->occluded(r, tmax)) {
+				hit = true;
+				blocker = objs[k];
+			}
+		}
+		bool done(double) const { return hit; }
+
+		const std::vector<Obj*>& objs;
+		ray& r;
+		double tmax;
+		bool hit;
+		const Obj* blocker;
+	};
+
+	// The id of the ray a thread is walking, and for each object the id of
+	// the last ray that tested it.
+	struct Mailbox {
+		Mailbox() : id(0) {}
+		std::vector<unsigned> stamp;
+		unsigned id;
+	};
+
+	// This thread's mailbox, with a fresh id for a new ray.
+	Mailbox& mailbox() const {
+		static thread_local Mailbox box;
+		if (box.stamp.size() < objs.size()) box.stamp.resize(objs.size(), 0);
+		if (++box.id == 0) {
+			// wrapped: forget every stamp rather than match an old ray
+			std::fill(box.stamp.begin(), box.stamp.end(), 0u);
+			box.id = 1;
+		}
+		return box;
+	}
+
+	static int cellIndex(const Level& l, int x, int y, int z) {
+		return (z * l.res[1] + y) * l.res[0] + x;
+	}
+
+	static int toCell(const Level& l, int axis, double v) {
+		int c = (int)((v - l.bounds.getMin()[axis]) * l.invCellSize[axis]);
+		return c < 0 ? 0 : (c >= l.res[axis] ? l.res[axis] - 1 : c);
+	}
+
+	void fill(int index, const BoundingBox& b, const std::vector<int>& members, int density, bool top) {
+		// Pad the box a little so flat scenes still have thickness and
+		// objects lying on the boundary land inside.
+		Vec3d bmin = b.getMin();
+		Vec3d bmax = b.getMax();
+		Vec3d extent = bmax - bmin;
+		double maxExtent = std::max(extent[0], std::max(extent[1], extent[2]));
+		double pad = 1.0e-6 * maxExtent + 1.0e-9;
+		for (int axis = 0; axis < 3; ++axis) {
+			bmin[axis] -= pad;
+			bmax[axis] += pad;
+		}
+		extent = bmax - bmin;
+		maxExtent = std::max(extent[0], std::max(extent[1], extent[2]));
+
+		Level l;
+		l.bounds.setMin(bmin);
+		l.bounds.setMax(bmax);
+		double perUnit = density * std::cbrt((double)members.size()) / maxExtent;
+		for (int axis = 0; axis < 3; ++axis) {
+			int n = (int)(extent[axis] * perUnit + 0.5);
+			l.res[axis] = std::max(1, std::min(n, (int)MAX_RES));
+			l.cellSize[axis] = extent[axis] / l.res[axis];
+			l.invCellSize[axis] = 1.0 / l.cellSize[axis];
+		}
+
+		// Count, then place, each object in every cell its box overlaps.
+		int nCells = l.res[0] * l.res[1] * l.res[2];
+		l.cells.assign(nCells + 1, 0);
+		for (int pass = 0; pass < 2; ++pass) {
+			if (pass == 1) {
+				for (int c = 0; c < nCells; ++c) l.cells[c + 1] += l.cells[c];
+				l.items.resize(l.cells[nCells]);
+				for (int c = nCells; c > 0; --c) l.cells[c] = l.cells[c - 1];
+				l.cells[0] = 0;
+			}
+			for (size_t k = 0; k < members.size(); ++k) {
+				const BoundingBox& box = objs[members[k]]->getBoundingBox();
+				int lo[3], hi[3];
+				for (int axis = 0; axis < 3; ++axis) {
+					lo[axis] = toCell(l, axis, box.getMin()[axis]);
+					hi[axis] = toCell(l, axis, box.getMax()[axis]);
+				}
+				for (int z = lo[2]; z <= hi[2]; ++z)
+					for (int y = lo[1]; y <= hi[1]; ++y)
+						for (int x = lo[0]; x <= hi[0]; ++x) {
+							int c = cellIndex(l, x, y, z);
+							if (pass == 0) ++l.cells[c + 1];
+							else l.items[l.cells[c + 1]++] = members[k];
+						}
+			}
+		}
+		l.sub.assign(top ? nCells : 0, 0);
+		levels[index] = l;
+
+		if (!top) return;
+
+		// Second level for the crowded cells.
+		for (int z = 0; z < l.res[2]; ++z)
+			for (int y = 0; y < l.res[1]; ++y)
+				for (int x = 0; x < l.res[0]; ++x) {
+					int c = cellIndex(l, x, y, z);
+					int count = l.cells[c + 1] - l.cells[c];
+					if (count <= SUBGRID_MIN) continue;
+
+					Vec3d cmin(bmin[0] + x * l.cellSize[0], bmin[1] + y * l.cellSize[1],
+						bmin[2] + z * l.cellSize[2]);
+					std::vector<int> inCell(l.items.begin() + l.cells[c], l.items.begin() + l.cells[c + 1]);
+					int sub = (int)levels.size();
+					levels.push_back(Level());
+					fill(sub, BoundingBox(cmin, cmin + l.cellSize), inCell, SUB_DENSITY, false);
+					levels[index].sub[c] = sub;
+				}
+	}
+
+	// 3D-DDA through level l over the ray segment [t0, t1], handing each
+	// cell's objects not yet stamped in box to visit.  Returns true once
+	// visit says it is done.
+	template <typename Visit>
+	bool walk(const Level& l, ray& r, double t0, double t1, Visit& visit, Mailbox& box) const {
+		const Vec3d& p = r.getPosition();
+		const Vec3d& d = r.getDirection();
+
+		int cell[3], step[3], out[3];
+		double next[3], delta[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			double pos = p[axis] + d[axis] * t0;
+			cell[axis] = toCell(l, axis, pos);
+			double lo = l.bounds.getMin()[axis] + cell[axis] * l.cellSize[axis];
+			if (d[axis] > 0.0) {
+				next[axis] = t0 + (lo + l.cellSize[axis] - pos) * r.invd[axis];
+				delta[axis] = l.cellSize[axis] * r.invd[axis];
+				step[axis] = 1;
+				out[axis] = l.res[axis];
+			}
+			else if (d[axis] < 0.0) {
+				next[axis] = t0 + (lo - pos) * r.invd[axis];
+				delta[axis] = -l.cellSize[axis] * r.invd[axis];
+				step[axis] = -1;
+				out[axis] = -1;
+			}
+			else {
+				next[axis] = 1.0e308;
+				delta[axis] = 1.0e308;
+				step[axis] = 0;
+				out[axis] = -1;
+			}
+		}
+
+		double enter = t0;
+		for (;;) {
+			int axis = (next[0] < next[1]) ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+			double exit = std::min(next[axis], t1);
+			int c = cellIndex(l, cell[0], cell[1], cell[2]);
+
+			if (!l.sub.empty() && l.sub[c]) {
+				if (walk(levels[l.sub[c]], r, enter, exit, visit, box)) return true;
+			}
+			else {
+				for (int k = l.cells[c]; k < l.cells[c + 1]; ++k) {
+					int item = l.items[k];
+					if (box.stamp[item] == box.id) continue;
+					box.stamp[item] = box.id;
+					visit.visit(item);
+				}
+			}
+			if (visit.done(exit)) return true;
+
+			if (next[axis] >= t1) return false;
+			cell[axis] += step[axis];
+			if (cell[axis] == out[axis]) return false;
+			enter = next[axis];
+			next[axis] += delta[axis];
+		}
+	}
+
+	std::vector<Obj*> objs;
+	std::vector<Level> levels;
+};
+
+#endif // __GRID_H__
@@ -0,0 +1,337 @@
+//
+// kdTree.h
+//
+// A kd-tree over anything that can report a bounding box and intersect
+// a ray.  Split planes are chosen with the surface area heuristic from
+// the bounding box edges of the objects in each node; objects that
+// straddle a plane are referenced from both sides.  Traversal walks the
+// cells along the ray front-to-back with an explicit stack and stops as
+// soon as a hit is found inside the current cell.  Split planes are
+// stored in Real, so a -DRAY_SINGLE_PRECISION build has smaller nodes;
+// each plane is rounded before the objects are sorted against it, so the
+// build and the traversal agree on which side everything lies.
+//
+// Obj must provide:
+//     const BoundingBox& getBoundingBox() const;
+//     bool intersect(ray& r, isect& i) const;
+//     bool occluded(ray& r, double tmax) const;
+//
+
+#ifndef __KDTREE_H__
+#define __KDTREE_H__
+
+#include <vector>
+#include <algorithm>
+
+#include "ray.h"
+#include "bbox.h"
+
+template <typename Obj>
+class KdTree {
+
+public:
+	KdTree(const std::vector<Obj*>& objects, int depth, int leafSize)
+		: objs(objects), maxDepth(std::min(std::max(depth, 0), (int)MAX_STACK)),
+		  targetLeafSize(leafSize < 1 ? 1 : leafSize)
+	{
+		if (objs.empty()) return;
+
+		std::vector<BoundingBox> boxes(objs.size());
+		std::vector<int> indices(objs.size());
+		for (size_t k = 0; k < objs.size(); ++k) {
+			boxes[k] = objs[k]->getBoundingBox();
+			bounds.merge(boxes[k]);
+			indices[k] = (int)k;
+		}
+
+		build(boxes, indices, bounds, 0);
+	}
+
+	// Find the closest intersection of r with any object in the tree.
+	bool intersect(ray& r, isect& i) const {
+		double tmin, tmax;
+		if (nodes.empty() || !bounds.intersect(r, tmin, tmax)) return false;
+		if (tmax > r.tmax) tmax = r.tmax;
+
+		const Vec3d& p = r.getPosition();
+		const Vec3d& d = r.getDirection();
+		const Vec3d invd = r.invd;
+
+		struct Entry { int node; double tmin, tmax; };
+		Entry stack[MAX_STACK];
+		int sp = 0;
+
+		bool have_one = false;
+		int current = 0;
+		for (;;) {
+			// Once the ray's interval (shrunk by each hit) ends in front of
+			// this cell, nothing farther along can beat it.
+			if (r.tmax < tmin) break;
+
+			const Node& node = nodes[current];
+			if (!node.isLeaf()) {
+				int axis = node.axis();
+				int below = current + 1;
+				int above = node.above();
+
+				if (d[axis] == 0.0) {
+					current = (p[axis] < node.split) ? below : above;
+					continue;
+				}
+
+				double tplane = (node.split - p[axis]) * invd[axis];
+				bool belowFirst = (p[axis] < node.split) ||
+					(p[axis] == node.split && d[axis] <= 0.0);
+				int first = belowFirst ? below : above;
+				int second = belowFirst ? above : below;
+
+				if (tplane > tmax || tplane <= 0.0) current = first;
+				else if (tplane < tmin) current = second;
+				else {
+					if (sp < MAX_STACK) {
+						stack[sp].node = second;
+						stack[sp].tmin = tplane;
+						stack[sp++].tmax = tmax;
+					}
+					current = first;
+					tmax = tplane;
+				}
+				continue;
+			}
+
+			for (int k = node.first(); k < node.first() + node.count(); ++k) {
+				isect cur;
+				if (objs[objIndices[k]]->intersect(r, cur) && (!have_one || cur.t < i.t)) {
+					i = cur;
+					have_one = true;
+				}
+			}
+			if (have_one && i.t <= tmax) break;
+
+			if (sp == 0) break;
+			--sp;
+			current = stack[sp].node;
+			tmin = stack[sp].tmin;
+			tmax = stack[sp].tmax;
+		}
+		return have_one;
+	}
+
+	// Is there any object along r closer than limit?  Same front-to-back
+	// walk, but cells past limit are never entered and the first hit ends
+	// it; its object goes in blocker if one is given.
+	bool occluded(ray& r, double limit, const Obj** blocker = 0) const {
+		double tmin, tmax;
+		if (nodes.empty() || !bounds.intersect(r, tmin, tmax) || tmin >= limit) return false;
+		if (tmax > limit) tmax = limit;
+
+		const Vec3d& p = r.getPosition();
+		const Vec3d& d = r.getDirection();
+		const Vec3d invd = r.invd;
+
+		struct Entry { int node; double tmin, tmax; };
+		Entry stack[MAX_STACK];
+		int sp = 0;
+
+		int current = 0;
+		for (;;) {
+			const Node& node = nodes[current];
+			if (!node.isLeaf()) {
+				int axis = node.axis();
+				int below = current + 1;
+				int above = node.above();
+
+				if (d[axis] == 0.0) {
+					current = (p[axis] < node.split) ? below : above;
+					continue;
+				}
+
+				double tplane = (node.split - p[axis]) * invd[axis];
+				bool belowFirst = (p[axis] < node.split) ||
+					(p[axis] == node.split && d[axis] <= 0.0);
+				int first = belowFirst ? below : above;
+				int second = belowFirst ? above : below;
+
+				if (tplane > tmax || tplane <= 0.0) current = first;
+				else if (tplane < tmin) current = second;
+				else {
+					if (sp < MAX_STACK) {
+						stack[sp].node = second;
+						stack[sp].tmin = tplane;
+						stack[sp++].tmax = tmax;
+					}
+					current = first;
+					tmax = tplane;
+				}
+				continue;
+			}
+
+			for (int k = node.first(); k < node.first() + node.count(); ++k)
+				if (objs[objIndices[k]]->occluded(r, limit)) {
+					if (blocker) *blocker = objs[objIndices[k]];
+					return true;
+				}
+
+			if (sp == 0) return false;
+			--sp;
+			current = stack[sp].node;
+			tmin = stack[sp].tmin;
+			tmax = stack[sp].tmax;
+		}
+	}
+
+	int getMaxDepth() const { return maxDepth; }
+	int getLeafSize() const { return targetLeafSize; }
+
+	// Memory held by the nodes and their object lists.
+	size_t bytes() const {
+		return nodes.size() * sizeof(Node) + objIndices.size() * sizeof(int) + objs.size() * sizeof(Obj*);
+	}
+	int nodeCount() const { return (int)nodes.size(); }
+
+private:
+	static const int MAX_STACK = 128;
+
+	// Relative costs of stepping through a node vs. testing a primitive,
+	// and the discount for splits that cut off empty space.
+	static double traversalCost() { return 1.0; }
+	static double intersectCost() { return 1.5; }
+	static double emptyBonus() { return 0.2; }
+
+	// Nodes live in one array.  An interior node's "below" child directly
+	// follows it; the "above" child is stored by index.  The low two bits
+	// of flags hold the split axis (3 marks a leaf), the rest hold either
+	// the above child or, for leaves, the object count.
+	struct Node {
+		Real split;			// interior: plane position; leaf: unused
+		int offset;			// leaf: first entry in objIndices
+		int flags;
+
+		bool isLeaf() const { return (flags & 3) == 3; }
+		int axis() const { return flags & 3; }
+		int above() const { return flags >> 2; }
+		int first() const { return offset; }
+		int count() const { return flags >> 2; }
+	};
+
+	struct Edge {
+		double t;
+		int obj;
+		bool start;
+		bool operator<(const Edge& e) const {
+			// at the same position, end events sort before start events
+			if (t == e.t) return !start && e.start;
+			return t < e.t;
+		}
+	};
+
+	static double area(const Vec3d& d) {
+		return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+	}
+
+	void makeLeaf(const std::vector<int>& indices) {
+		Node leaf;
+		leaf.split = 0.0;
+		leaf.offset = (int)objIndices.size();
+		leaf.flags = 3 | ((int)indices.size() << 2);
+		objIndices.insert(objIndices.end(), indices.begin(), indices.end());
+		nodes.push_back(leaf);
+	}
+
+	void build(const std::vector<BoundingBox>& boxes, const std::vector<int>& indices,
+		const BoundingBox& nodeBounds, int depth)
+	{
+		int n = (int)indices.size();
+		if (n <= targetLeafSize || depth >= maxDepth) {
+			makeLeaf(indices);
+			return;
+		}
+
+		// Find the cheapest plane among all box edges on all three axes.
+		Vec3d bmin = nodeBounds.getMin();
+		Vec3d bmax = nodeBounds.getMax();
+		Vec3d extent = bmax - bmin;
+		double invArea = 1.0 / area(extent);
+		double bestCost = 1e308;
+		double bestSplit = 0.0;
+		int bestAxis = -1;
+
+		std::vector<Edge> edges(2 * n);
+		for (int axis = 0; axis < 3; ++axis) {
+			for (int k = 0; k < n; ++k) {
+				const BoundingBox& b = boxes[indices[k]];
+				edges[2 * k].t = b.getMin()[axis];
+				edges[2 * k].obj = indices[k];
+				edges[2 * k].start = true;
+				edges[2 * k + 1].t = b.getMax()[axis];
+				edges[2 * k + 1].obj = indices[k];
+				edges[2 * k + 1].start = false;
+			}
+			std::sort(edges.begin(), edges.end());
+
+			int otherA = (axis + 1) % 3;
+			int otherB = (axis + 2) % 3;
+			int nBelow = 0, nAbove = n;
+			for (int k = 0; k < 2 * n; ++k) {
+				if (!edges[k].start) --nAbove;
+				double t = edges[k].t;
+				if (t > bmin[axis] && t < bmax[axis]) {
+					double belowArea = 2.0 * (extent[otherA] * extent[otherB] +
+						(t - bmin[axis]) * (extent[otherA] + extent[otherB]));
+					double aboveArea = 2.0 * (extent[otherA] * extent[otherB] +
+						(bmax[axis] - t) * (extent[otherA] + extent[otherB]));
+					double bonus = (nBelow == 0 || nAbove == 0) ? emptyBonus() : 0.0;
+					double cost = traversalCost() + intersectCost() * (1.0 - bonus) *
+						(belowArea * invArea * nBelow + aboveArea * invArea * nAbove);
+					if (cost < bestCost) {
+						bestCost = cost;
+						bestAxis = axis;
+						bestSplit = t;
+					}
+				}
+				if (edges[k].start) ++nBelow;
+			}
+		}
+
+		if (bestAxis < 0 || bestCost > intersectCost() * n) {
+			makeLeaf(indices);
+			return;
+		}
+
+		const Real split = (Real)bestSplit;
+		std::vector<int> below, above;
+		for (int k = 0; k < n; ++k) {
+			const BoundingBox& b = boxes[indices[k]];
+			if (b.getMin()[bestAxis] < split) below.push_back(indices[k]);
+			if (b.getMax()[bestAxis] > split) above.push_back(indices[k]);
+			// flat boxes lying exactly on the plane still need a home
+			if (b.getMin()[bestAxis] == split && b.getMax()[bestAxis] == split)
+				below.push_back(indices[k]);
+		}
+
+		int self = (int)nodes.size();
+		Node interior;
+		interior.split = split;
+		interior.offset = 0;
+		interior.flags = bestAxis;
+		nodes.push_back(interior);
+
+		BoundingBox belowBounds = nodeBounds;
+		BoundingBox aboveBounds = nodeBounds;
+		belowBounds.setMax(bestAxis, split);
+		aboveBounds.setMin(bestAxis, split);
+
+		build(boxes, below, belowBounds, depth + 1);
+		nodes[self].flags = bestAxis | ((int)nodes.size() << 2);
+		build(boxes, above, aboveBounds, depth + 1);
+	}
+
+	std::vector<Obj*> objs;
+	std::vector<int> objIndices;
+	std::vector<Node> nodes;
+	BoundingBox bounds;
+	int maxDepth;
+	int targetLeafSize;
+};
+
+#endif // __KDTREE_H__
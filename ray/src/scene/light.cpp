@@ -1,9 +1,96 @@
 #include <cmath>
+#include <mutex>
 
 #include "light.h"
 
 using namespace std;
 
+// Ids are never reused, so a cache slot left over from a light that has
+// since been deleted is simply never looked at again.
+std::atomic<int> Light::nextId(0);
+
+namespace {
+
+// What one thread keeps for one light: the object that blocked its last
+// shadow ray, and the thread's share of the light's counts.
+struct ShadowSlot {
+  ShadowSlot() : last(0) {}
+  const Geometry* last;
+  Light::ShadowStats stats;
+};
+typedef vector<ShadowSlot> ShadowSlots;
+
+// Every thread's slots, indexed by light id.  A thread that ends hands
+// its slots back for the next new thread to carry on with, so counts
+// outlive the threads that made them and sums can run over allSlots.
+// The lock guards the lists, and a thread growing its own slots.
+mutex slotsLock;
+vector<ShadowSlots*> allSlots;
+vector<ShadowSlots*> freeSlots;
+
+struct ThreadSlots {
+  ThreadSlots() {
+    lock_guard<mutex> lock( slotsLock );
+    if( freeSlots.empty() ) {
+      slots = new ShadowSlots;
+      allSlots.push_back( slots );
+    } else {
+      slots = freeSlots.back();
+      freeSlots.pop_back();
+    }
+  }
+  ~ThreadSlots() {
+    lock_guard<mutex> lock( slotsLock );
+    freeSlots.push_back( slots );
+  }
+  ShadowSlots* slots;
+};
+
+}
+
+bool Light::occluded(ray& r, double tmax) const
+{
+  static thread_local ThreadSlots mine;
+  ShadowSlots& slots = *mine.slots;
+  if( (int)slots.size() <= id ) {
+    lock_guard<mutex> lock( slotsLock );
+    slots.resize( id + 1 );
+  }
+  ShadowSlot& slot = slots[id];
+
+  ++slot.stats.queries;
+  if( slot.last ) {
+    ++slot.stats.cacheTries;
+    if( slot.last->occluded(r, tmax) ) {
+      ++slot.stats.cacheHits;
+      ++slot.stats.blocked;
+      return true;
+    }
+  }
+
+  const Geometry* blocker = 0;
+  if( !scene->occluded(r, tmax, &blocker) ) return false;
+  slot.last = blocker;
+  ++slot.stats.blocked;
+  return true;
+}
+
+Light::ShadowStats Light::shadowStats() const
+{
+  ShadowStats sum;
+  lock_guard<mutex> lock( slotsLock );
+  for( size_t k = 0; k < allSlots.size(); ++k )
+    if( (int)allSlots[k]->size() > id ) sum += (*allSlots[k])[id].stats;
+  return sum;
+}
+
+void Light::resetShadowStats()
+{
+  lock_guard<mutex> lock( slotsLock );
+  for( size_t k = 0; k < allSlots.size(); ++k )
+    if( (int)allSlots[k]->size() > id ) (*allSlots[k])[id].stats = ShadowStats();
+}
+
 double DirectionalLight::distanceAttenuation(const Vec3d& P) const
 {
   // distance to light is infinite, so f(di) goes to 0.  Return 1.
@@ -11,19 +98,17 @@ double DirectionalLight::distanceAttenuation(const Vec3d& P) const
 }
 
 
-Vec3d DirectionalLight::shadowAttenuation(const ray& r, const Vec3d& p) const
+Vec3d DirectionalLight::shadowAttenuation(const ray& /*r*/, const Vec3d& p) const
 {
   // YOUR CODE HERE:
   // You should implement shadow-handling code here.
   Vec3d ret = Vec3d(1.0,1.0,1.0);
-  isect i; 
-  ray temp = r;
-  temp.p = p;
-  temp.d = getDirection(p);
+  // a fresh ray, so the interval left over from r's own search is dropped
+  ray temp(p, getDirection(p), ray::SHADOW);
 
   //since directional lights "posistion" is at infinity,
-  //an intersected object will always be before it
-  if(scene->intersect(temp,i)) {
+  //any object along the ray is in front of it
+  if(occluded(temp, 1.0e308)) {
           ret = Vec3d(0.0,0.0,0.0);
 
   }
@@ -75,26 +160,18 @@ Vec3d PointLight::getDirection(const Vec3d& P) const
 }
 
 
-Vec3d PointLight::shadowAttenuation(const ray& r, const Vec3d& p) const
+Vec3d PointLight::shadowAttenuation(const ray& /*r*/, const Vec3d& p) const
 {
   // YOUR CODE HERE:
   // You should implement shadow-handling code here.
   Vec3d ret = Vec3d(1.0,1.0,1.0);
-  isect i; 
-  ray temp = r;
-  temp.p = p;
-  temp.d = getDirection(p);
-
-  if(scene->intersect(temp,i)) {
-      Vec3d Q = temp.at(i.t); //intersection point
-      //need to check to see if this point is before or after the lights source position
-      float lightDist = (p - position).length();
-      float isectDist = (p - Q).length();
-      if(isectDist < lightDist) {
-          ret = Vec3d(0.0,0.0, 0.0);
-
-      }
+  ray temp(p, getDirection(p), ray::SHADOW);
 
+  //only objects between p and the light source cast a shadow;
+  //temp.d is unit length, so t is the distance from p
+  double lightDist = (p - position).length();
+  if(occluded(temp, lightDist)) {
+      ret = Vec3d(0.0,0.0, 0.0);
   }
 
   return ret;
@@ -7,6 +7,8 @@ using std::min;
 using std::max;
 #endif
 
+#include <atomic>
+
 #include "scene.h"
 #include "../ui/TraceUI.h"
 
@@ -19,11 +21,42 @@ public:
 	virtual Vec3d getColor() const = 0;
 	virtual Vec3d getDirection (const Vec3d& P) const = 0;
 
+	// Shadow rays traced toward this light, how many were blocked, and
+	// how many the last-occluder cache was tried on and answered.  Each
+	// thread counts its own, so the hot path never shares a cache line;
+	// shadowStats() sums them.  Read and reset them only between renders.
+	struct ShadowStats {
+		ShadowStats() : queries(0), blocked(0), cacheTries(0), cacheHits(0) {}
+		ShadowStats& operator+=(const ShadowStats& s) {
+			queries += s.queries;
+			blocked += s.blocked;
+			cacheTries += s.cacheTries;
+			cacheHits += s.cacheHits;
+			return *this;
+		}
+		long queries;
+		long blocked;
+		long cacheTries;
+		long cacheHits;
+	};
+	ShadowStats shadowStats() const;
+	void resetShadowStats();
+
 protected:
-	Light(Scene *scene, const Vec3d& col) : SceneElement(scene), color(col) {}
+	Light(Scene *scene, const Vec3d& col) : SceneElement(scene), color(col), id(nextId++) {}
+
+	// Is anything along r closer than tmax?  Neighbouring shadow rays
+	// tend to hit the same blocker, so the object that blocked this
+	// light's last shadow ray on the calling thread is tried before the
+	// scene is searched.
+	bool occluded(ray& r, double tmax) const;
 
 	Vec3d color;
 
+private:
+	int id;			// this light's slot in each thread's occluder cache and counts
+	static std::atomic<int> nextId;
+
 public:
 	virtual void glDraw(GLenum lightID) const { }
 	virtual void glDraw() const { }
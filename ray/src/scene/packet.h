@@ -0,0 +1,143 @@
+//
+// packet.h
+//
+// A bundle of up to 64 rays traced together, typically the primary rays
+// of an 8x8 tile.  Every ray keeps its own interval and hit record; the
+// packet adds interval bounds on the origins and inverse directions of
+// all its rays, so a box none of them can enter is rejected with a single
+// interval-arithmetic test instead of one slab test per ray.
+//
+// The bounds only mean something while each direction component has one
+// sign across the packet (no ray may be parallel to a slab either).
+// Packets that don't are not coherent, and are traced a ray at a time.
+//
+// The rays and hits live in fixed arrays inside the packet, so making
+// one, as Geometry::intersect does for every object a packet reaches,
+// costs no heap allocation.
+//
+
+#ifndef __PACKET_H__
+#define __PACKET_H__
+
+#include <array>
+#include <algorithm>
+#include <stdint.h>
+
+#include "ray.h"
+
+class RayPacket {
+public:
+	enum { MAX = 64 };
+	typedef uint64_t Mask;
+
+	RayPacket() : found(0), count(0), isCoherent(false) {}
+
+	// Callers add at most MAX rays.
+	void add(const ray& r) {
+		rays[count] = r;
+		hits[count] = isect();
+		++count;
+	}
+
+	// Empty the packet for reuse.
+	void clear() {
+		count = 0;
+		found = 0;
+		isCoherent = false;
+	}
+
+	int size() const { return count; }
+	Mask all() const { return count == MAX ? ~(Mask)0 : ((Mask)1 << count) - 1; }
+	static Mask bit(int j) { return (Mask)1 << j; }
+
+	ray& operator[](int j) { return rays[j]; }
+	const ray& operator[](int j) const { return rays[j]; }
+
+	// Hit record of ray j; only meaningful if its bit is set in found.
+	isect& hit(int j) { return hits[j]; }
+
+	// Take cur as ray j's hit if it has none yet or cur is closer.
+	bool offer(int j, const isect& cur) {
+		if ((found & bit(j)) && cur.t >= hits[j].t) return false;
+		hits[j] = cur;
+		found |= bit(j);
+		return true;
+	}
+
+	// Work out the bounds over every ray.  Call once the rays are in, and
+	// again if they are moved.
+	void bound() {
+		isCoherent = count > 0;
+		for (int axis = 0; axis < 3; ++axis) {
+			oLo[axis] = iLo[axis] = 1.0e308;
+			oHi[axis] = iHi[axis] = -1.0e308;
+		}
+		for (int j = 0; j < count; ++j) {
+			const Vec3d& p = rays[j].p;
+			const Vec3d& d = rays[j].d;
+			const Vec3d& invd = rays[j].invd;
+			for (int axis = 0; axis < 3; ++axis) {
+				oLo[axis] = std::min(oLo[axis], p[axis]);
+				oHi[axis] = std::max(oHi[axis], p[axis]);
+				iLo[axis] = std::min(iLo[axis], invd[axis]);
+				iHi[axis] = std::max(iHi[axis], invd[axis]);
+				if (d[axis] == 0.0 || (d[axis] < 0.0) != (rays[0].d[axis] < 0.0)) isCoherent = false;
+			}
+		}
+	}
+
+	bool coherent() const { return isCoherent; }
+	bool dirNeg(int axis) const { return iHi[axis] < 0.0; }
+
+	// Could any ray of the packet meet the box [lo, hi] before tmax?  If
+	// so, tNear is a lower bound on where they enter it.
+	bool mayHit(const double lo[3], const double hi[3], double tmax, double& tNear) const {
+		double enter = 0.0;
+		double leave = tmax;
+		for (int axis = 0; axis < 3; ++axis) {
+			bool neg = dirNeg(axis);
+			double nearB = neg ? hi[axis] : lo[axis];
+			double farB = neg ? lo[axis] : hi[axis];
+			// (nearB - o) / d over every o and d in the packet, and the same
+			// for farB: products of intervals, so check all four corners.
+			enter = std::max(enter, std::min(std::min((nearB - oLo[axis]) * iLo[axis], (nearB - oLo[axis]) * iHi[axis]),
+				std::min((nearB - oHi[axis]) * iLo[axis], (nearB - oHi[axis]) * iHi[axis])));
+			leave = std::min(leave, std::max(std::max((farB - oLo[axis]) * iLo[axis], (farB - oLo[axis]) * iHi[axis]),
+				std::max((farB - oHi[axis]) * iLo[axis], (farB - oHi[axis]) * iHi[axis])));
+		}
+		tNear = enter;
+		return enter <= leave;
+	}
+
+	// The largest tmax of the rays in m.
+	double farthest(Mask m) const {
+		double t = 0.0;
+		for (; m; m &= m - 1) t = std::max(t, rays[lowestBit(m)].tmax);
+		return t;
+	}
+
+	static int lowestBit(Mask m) {
+#if defined(__GNUC__)
+		return __builtin_ctzll(m);
+#else
+		int k = 0;
+		while (!(m & 1)) {
+			m >>= 1;
+			++k;
+		}
+		return k;
+#endif
+	}
+
+	Mask found;		// rays with a hit record
+
+private:
+	std::array<ray, MAX> rays;
+	std::array<isect, MAX> hits;
+	int count;		// rays in use, from the start of rays and hits
+	double oLo[3], oHi[3];	// bounds on the origins
+	double iLo[3], iHi[3];	// and on the inverse directions
+	bool isCoherent;
+};
+
+#endif // __PACKET_H__
@@ -3,7 +3,7 @@
 #include "scene.h"
 
 const Material &
-isect::getMaterial() const
+isect::getMaterial( Material& blend ) const
 {
-    return material ? *material : obj->getMaterial();
+    return material ? *material : obj->materialAt( *this, blend );
 }
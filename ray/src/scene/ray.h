@@ -17,8 +17,21 @@
 
 class SceneObject;
 
+const double RAY_EPSILON = 0.00000001;
+const double RAY_TMAX = 1.0e308;
+
 // A ray has a position where the ray starts, and a direction (which should
 // always be normalized!)
+//
+// It also carries the interval [tmin, tmax] of distances along it that
+// are still of interest.  Intersection routines ignore hits outside it,
+// and a successful intersect() shrinks tmax to the hit, so objects and
+// boxes farther away are rejected without the full test.  Reset it with
+// setInterval() before reusing a ray for a new query.
+//
+// The reciprocal of the direction and the sign of each of its components
+// are cached for slab tests against boxes, so change d only through
+// setDirection(), which keeps them up to date.
 
 class ray {
 public:
@@ -31,12 +44,20 @@ public:
 	};
 
         ray(const Vec3d &pp, const Vec3d &dd, RayType tt = VISIBILITY)
-	  : p(pp), d(dd), t(tt) {}
-        ray(const ray& other) : p(other.p), d(other.d), t(other.t) {}
+	  : p(pp), d(dd), t(tt), tmin(RAY_EPSILON), tmax(RAY_TMAX) { cacheInverse(); }
+	// A placeholder to be assigned over, for fixed-size storage (see
+	// RayPacket).
+	ray() : t(VISIBILITY), tmin(RAY_EPSILON), tmax(RAY_TMAX) { sign[0] = sign[1] = sign[2] = 0; }
+        ray(const ray& other) : p(other.p), d(other.d), invd(other.invd), t(other.t), tmin(other.tmin), tmax(other.tmax)
+	{ sign[0] = other.sign[0]; sign[1] = other.sign[1]; sign[2] = other.sign[2]; }
 	~ray() {}
 
 	ray& operator =( const ray& other ) 
-	{ p = other.p; d = other.d; t = other.t; return *this; }
+	{ p = other.p; d = other.d; invd = other.invd; t = other.t; tmin = other.tmin; tmax = other.tmax;
+	  sign[0] = other.sign[0]; sign[1] = other.sign[1]; sign[2] = other.sign[2]; return *this; }
+
+	void setDirection( const Vec3d& dd )
+	{ d = dd; cacheInverse(); }
 
 	Vec3d at( double t ) const
 	{ return p + (t*d); }
@@ -45,10 +66,28 @@ public:
 	Vec3d getDirection() const { return d; }
 	RayType type() const { return t; }
 
+	void setInterval( double lo = RAY_EPSILON, double hi = RAY_TMAX )
+	{ tmin = lo; tmax = hi; }
+	// Is t inside the interval still being searched?
+	bool inside( double tt ) const { return tt > tmin && tt <= tmax; }
+
+private:
+	// a zero component gives an infinite reciprocal, of the zero's sign
+	void cacheInverse() {
+		for (int axis = 0; axis < 3; ++axis) {
+			invd[axis] = 1.0 / d[axis];
+			sign[axis] = invd[axis] < 0.0;
+		}
+	}
+
 public:
 	Vec3d p;
 	Vec3d d;
+	Vec3d invd;	// 1/d, per component
+	int sign[3];	// 1 where d points down the axis: box planes are bmin/bmax[sign], far ones [1 - sign]
 	RayType t;
+	double tmin;
+	double tmax;
 };
 
 // The description of an intersection point.
@@ -56,48 +95,22 @@ public:
 class isect
 {
 public:
-    isect() : obj( NULL ), t( 0.0 ), N(), material(0) {}
-	isect(const isect& other)
-	{
-		obj = other.obj;
-		t = other.t;
-		N = other.N;
-		bary = other.bary;
-		uvCoordinates = other.uvCoordinates;
-		if (other.material) material = new Material(*other.material);
-		else material = 0;
-	}
-
-	~isect() { delete material; }
-    
-    isect& operator = (const isect& other) {
-        if( this != &other ) {
-            obj = other.obj;
-            t = other.t;
-            N = other.N;
-			bary = other.bary;
-            uvCoordinates = other.uvCoordinates;
-			if( other.material ) {
-                if( material ) *material = *other.material;
-                else material = new Material(*other.material );
-            }
-            else {
-                delete material;
-                material = 0;
-            }
-        }
-        return *this;
-    }
+    isect() : obj( NULL ), t( 0.0 ), N(), face( -1 ), material( 0 ) {}
 
     void setObject(const SceneObject *o) { obj = o; }
     void setT(double tt) { t = tt; }
     void setN(const Vec3d& n) { N = n; }
-    void setMaterial(const Material& m)  { if(material) *material = m; else material = new Material(m); }
+    // Hit records only point at the hit object's material, so they can be
+    // copied around freely while the closest hit is being looked for.
+    void setMaterial(const Material& m)  { material = &m; }
     void setUVCoordinates( const Vec2d& coords ) { uvCoordinates = coords; }
     void setBary(const Vec3d& weights) { bary = weights; }
     void setBary(const double alpha, const double beta, const double gamma)
 		{ bary[0] = alpha; bary[1] = beta; bary[2] = gamma; }
-    const Material &getMaterial() const;
+    // The material to shade the hit with.  Where it varies over the
+    // object (a mesh with per-vertex materials) it is interpolated into
+    // blend, so look it up once per hit shaded, not per hit found.
+    const Material &getMaterial( Material& blend ) const;
 
 public:
     const SceneObject *obj;
@@ -105,11 +118,8 @@ public:
     Vec3d N;
     Vec2d uvCoordinates;
     Vec3d bary;
-    Material *material;         // if this intersection has its own material
-                                // (as opposed to one in its associated object)
-                                // as in the case where the material was interpolated
+    int face;                   // triangle hit, on a mesh
+    const Material *material;   // the object's material, if it has just one
 };
 
-const double RAY_EPSILON = 0.00000001;
-
 #endif // __RAY_H__
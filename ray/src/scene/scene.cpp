@@ -2,7 +2,10 @@
 
 #include "scene.h"
 #include "light.h"
+#include "kdTree.h"
+#include "grid.h"
 #include "../ui/TraceUI.h"
+extern TraceUI* traceUI;
 
 using namespace std;
 
@@ -10,25 +13,98 @@ bool Geometry::intersect(ray& r, isect& i) const {
 	double tmin, tmax;
 	if (hasBoundingBoxCapability() && !(bounds.intersect(r, tmin, tmax))) return false;
 	// Transform the ray into the object's local coordinate space
-	Vec3d pos = transform->globalToLocalCoords(r.p);
-	Vec3d dir = transform->globalToLocalCoords(r.p + r.d) - pos;
-	double length = dir.length();
-	dir /= length;
-	Vec3d Wpos = r.p;
-	Vec3d Wdir = r.d;
-	r.p = pos;
-	r.d = dir;
-	bool rtrn = false;
-	if (intersectLocal(r, i))
-	{
-		// Transform the intersection point & normal returned back into global space.
-		i.N = transform->localToGlobalCoordsNormal(i.N);
-		i.t /= length;
-		rtrn = true;
+	Vec3d pos, dir;
+	double length;
+	transform->globalToLocalRay(r.p, r.d, pos, dir, length);
+	ray local(pos, dir, r.type());
+	// local distances are world distances times length
+	local.setInterval(r.tmin * length, r.tmax * length);
+	if (!intersectLocal(local, i)) return false;
+	// The normal stays in local space until finalize().
+	i.t /= length;
+	// Only hits closer than this one are of interest from now on.
+	r.tmax = std::min(i.t, r.tmax);
+	return true;
+}
+
+RayPacket::Mask Geometry::intersect(RayPacket& p, RayPacket::Mask active) const {
+	if (!hasPacketIntersect()) {
+		RayPacket::Mask won = 0;
+		for (; active; active &= active - 1) {
+			int j = RayPacket::lowestBit(active);
+			isect cur;
+			if (intersect(p[j], cur) && p.offer(j, cur)) won |= RayPacket::bit(j);
+		}
+		return won;
+	}
+
+	// The rays that reach the bounds, moved into local space as in
+	// intersect(), make up a packet of their own.
+	RayPacket local;
+	int slot[RayPacket::MAX];
+	double length[RayPacket::MAX];
+	for (RayPacket::Mask m = active; m; m &= m - 1) {
+		int j = RayPacket::lowestBit(m);
+		ray& r = p[j];
+		double tmin, tmax;
+		if (hasBoundingBoxCapability() && !(bounds.intersect(r, tmin, tmax))) continue;
+		Vec3d pos, dir;
+		double len;
+		transform->globalToLocalRay(r.p, r.d, pos, dir, len);
+		ray lr(pos, dir, r.type());
+		lr.setInterval(r.tmin * len, r.tmax * len);
+		slot[local.size()] = j;
+		length[local.size()] = len;
+		local.add(lr);
+	}
+	if (local.size() == 0) return 0;
+	local.bound();
+
+	RayPacket::Mask won = 0;
+	for (RayPacket::Mask m = intersectLocal(local, local.all()); m; m &= m - 1) {
+		int k = RayPacket::lowestBit(m);
+		int j = slot[k];
+		isect& i = local.hit(k);
+		i.t /= length[k];
+		if (p.offer(j, i)) {
+			p[j].tmax = std::min(i.t, p[j].tmax);
+			won |= RayPacket::bit(j);
+		}
 	}
-	r.p = Wpos;
-	r.d = Wdir;
-	return rtrn;
+	return won;
+}
+
+RayPacket::Mask Geometry::intersectLocal(RayPacket& p, RayPacket::Mask active) const {
+	RayPacket::Mask won = 0;
+	for (; active; active &= active - 1) {
+		int j = RayPacket::lowestBit(active);
+		isect cur;
+		if (intersectLocal(p[j], cur) && p.offer(j, cur)) won |= RayPacket::bit(j);
+	}
+	return won;
+}
+
+void Geometry::finalize(isect& i) const {
+	finalizeLocal(i);
+	i.N = transform->localToGlobalCoordsNormal(i.N);
+}
+
+bool Geometry::occluded(ray& r, double tmax) const {
+	double tmin, tmaxBox;
+	if (hasBoundingBoxCapability() &&
+		(!bounds.intersect(r, tmin, tmaxBox) || tmin >= tmax)) return false;
+	// Same change of space as intersect(); local distances are scaled by length.
+	Vec3d pos, dir;
+	double length;
+	transform->globalToLocalRay(r.p, r.d, pos, dir, length);
+	ray local(pos, dir, r.type());
+	local.setInterval(r.tmin * length, r.tmax * length);
+	return occludedLocal(local, tmax * length);
+}
+
+bool Geometry::occludedLocal(ray& r, double tmax) const {
+	isect i;
+	return intersectLocal(r, i) && i.t < tmax;
 }
 
 bool Geometry::hasBoundingBoxCapability() const {
@@ -50,6 +126,102 @@ Scene::~Scene() {
     for( g = objects.begin(); g != objects.end(); ++g ) delete (*g);
     for( l = lights.begin(); l != lights.end(); ++l ) delete (*l);
     for( t = textureCache.begin(); t != textureCache.end(); t++ ) delete (*t).second;
+    delete bvh;
+    delete kdtree;
+    delete grid;
+}
+
+void Scene::splitBoundedObjects() {
+	boundedobjects.clear();
+	nonboundedobjects.clear();
+	for (cgiter g = objects.begin(); g != objects.end(); ++g) {
+		if ((*g)->hasBoundingBoxCapability()) boundedobjects.push_back(*g);
+		else nonboundedobjects.push_back(*g);
+	}
+}
+
+void Scene::buildBVH() {
+	splitBoundedObjects();
+	delete bvh;
+	bvh = new BVH<Geometry>(boundedobjects, 4, traceUI->getBVHWidth(), traceUI->getThreads(),
+		(BVH<Geometry>::Builder)traceUI->getBVHBuild(), traceUI->getBVHQuant());
+}
+
+void Scene::buildKdTree() {
+	splitBoundedObjects();
+	delete kdtree;
+	kdtree = new KdTree<Geometry>(boundedobjects, traceUI->getMaxDepth(), traceUI->getLeafSize());
+}
+
+void Scene::buildGrid() {
+	splitBoundedObjects();
+	delete grid;
+	grid = new Grid<Geometry>(boundedobjects, sceneBounds);
+}
+
+void Scene::setAccelerator(int accel, bool rebuild) {
+	switch (accel) {
+		case BVH_TREE:
+			if (rebuild || !bvh || !bvh->builtWith(traceUI->getBVHWidth(),
+				(BVH<Geometry>::Builder)traceUI->getBVHBuild(), traceUI->getBVHQuant())) buildBVH();
+			break;
+		case KD_TREE:
+			if (rebuild || !kdtree || kdtree->getMaxDepth() != traceUI->getMaxDepth() ||
+				kdtree->getLeafSize() != traceUI->getLeafSize()) buildKdTree();
+			break;
+		case GRID:
+			if (rebuild || !grid) buildGrid();
+			break;
+		default:
+			accel = LINEAR;
+	}
+	accelerator = accel;
+}
+
+bool Scene::updateBounds() {
+	sceneBounds.setEmpty();
+	for (giter g = objects.begin(); g != objects.end(); ++g) {
+		(*g)->ComputeBoundingBox();
+		sceneBounds.merge((*g)->getBoundingBox());
+	}
+
+	// A refit that leaves the expected cost per ray much higher means the
+	// objects have moved too far for the old topology.
+	bool refit = true;
+	if (bvh && !bvh->refit()) {
+		buildBVH();
+		refit = false;
+	}
+	if (kdtree) {
+		delete kdtree;
+		kdtree = 0;
+		if (accelerator == KD_TREE) buildKdTree();
+	}
+	if (grid) {
+		delete grid;
+		grid = 0;
+		if (accelerator == GRID) buildGrid();
+	}
+	return refit;
+}
+
+void Scene::printAcceleratorStats(std::ostream& os) const {
+	if (accelerator == BVH_TREE) bvh->stats().print(os, "scene BVH");
+	if (accelerator == GRID && grid->resolution()) {
+		const int* res = grid->resolution();
+		os << "scene grid: " << res[0] << "x" << res[1] << "x" << res[2] << " cells, "
+		   << grid->subgridCount() << " subgrids, " << grid->cellCount() << " cells in all, "
+		   << grid->referenceCount() << " references" << std::endl;
+	}
+	meshStats.print(os);
+	meshBVHStats.print(os, "mesh BVHs");
+}
+
+size_t Scene::acceleratorBytes() const {
+	if (accelerator == BVH_TREE) return bvh->stats().bytes;
+	if (accelerator == KD_TREE) return kdtree->bytes();
+	if (accelerator == GRID) return grid->bytes();
+	return objects.size() * sizeof(Geometry*);
 }
 
 // Get any intersection with an object.  Return information about the 
@@ -59,7 +231,11 @@ bool Scene::intersect(ray& r, isect& i) const {
 	double tmax = 0.0;
 	bool have_one = false;
 	typedef vector<Geometry*>::const_iterator iter;
-	for(iter j = objects.begin(); j != objects.end(); ++j) {
+	const vector<Geometry*>& linear = (accelerator == LINEAR) ? objects : nonboundedobjects;
+	if (accelerator == BVH_TREE) have_one = bvh->intersect(r, i);
+	else if (accelerator == KD_TREE) have_one = kdtree->intersect(r, i);
+	else if (accelerator == GRID) have_one = grid->intersect(r, i);
+	for(iter j = linear.begin(); j != linear.end(); ++j) {
 		isect cur;
 		if( (*j)->intersect(r, cur) ) {
 			if(!have_one || (cur.t < i.t)) {
@@ -68,12 +244,66 @@ bool Scene::intersect(ray& r, isect& i) const {
 			}
 		}
 	}
-	if(!have_one) i.setT(1000.0);
+	if(have_one) i.obj->finalize(i);
+	else i.setT(1000.0);
 	// if debugging,
 	if (TraceUI::m_debug) intersectCache.push_back(std::make_pair(new ray(r), new isect(i)));
 	return have_one;
 }
 
+void Scene::intersect(RayPacket& p) const {
+	p.found = 0;
+	if (accelerator != BVH_TREE) {
+		for (int j = 0; j < p.size(); ++j)
+			if (intersect(p[j], p.hit(j))) p.found |= RayPacket::bit(j);
+		return;
+	}
+	p.bound();
+	bvh->intersect(p, p.all());
+	typedef vector<Geometry*>::const_iterator iter;
+	for (iter j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j)
+		(*j)->intersect(p, p.all());
+	for (int j = 0; j < p.size(); ++j) {
+		if (p.found & RayPacket::bit(j)) p.hit(j).obj->finalize(p.hit(j));
+		else p.hit(j).setT(1000.0);
+		if (TraceUI::m_debug) intersectCache.push_back(std::make_pair(new ray(p[j]), new isect(p.hit(j))));
+	}
+}
+
+bool Scene::occluded(ray& r, double tmax, const Geometry** blocker) const {
+	typedef vector<Geometry*>::const_iterator iter;
+	const vector<Geometry*>& linear = (accelerator == LINEAR) ? objects : nonboundedobjects;
+	if (accelerator == BVH_TREE && bvh->occluded(r, tmax, blocker)) return true;
+	if (accelerator == KD_TREE && kdtree->occluded(r, tmax, blocker)) return true;
+	if (accelerator == GRID && grid->occluded(r, tmax, blocker)) return true;
+	for(iter j = linear.begin(); j != linear.end(); ++j)
+		if( (*j)->occluded(r, tmax) ) {
+			if (blocker) *blocker = *j;
+			return true;
+		}
+	return false;
+}
+
+void Scene::printShadowStats(std::ostream& os) const {
+	int k = 0;
+	for (cliter l = lights.begin(); l != lights.end(); ++l, ++k) {
+		Light::ShadowStats s = (*l)->shadowStats();
+		long queries = s.queries;
+		long blocked = s.blocked;
+		long tries = s.cacheTries;
+		long hits = s.cacheHits;
+		if (!queries) continue;
+		os << "light " << k << ": " << queries << " shadow rays, " << blocked << " blocked; "
+		   << "occluder cache hit " << hits << " of " << tries << " tries";
+		if (blocked) os << ", answering " << (100.0 * hits / blocked) << "% of blocked rays";
+		os << std::endl;
+	}
+}
+
+void Scene::resetShadowStats() {
+	for (liter l = lights.begin(); l != lights.end(); ++l) (*l)->resetShadowStats();
+}
+
 TextureMap* Scene::getTexture(string name) {
 	tmap::const_iterator itr = textureCache.find(name);
 	if(itr == textureCache.end()) {
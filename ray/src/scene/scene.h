@@ -20,6 +20,8 @@
 #include "material.h"
 #include "camera.h"
 #include "bbox.h"
+#include "bvh.h"
+#include "packet.h"
 
 #include "../vecmath/vec.h"
 #include "../vecmath/mat.h"
@@ -30,6 +32,10 @@ class Scene;
 template <typename Obj>
 class KdTree;
 
+template <typename Obj>
+class Grid;
+
+
 class SceneElement {
 
 public:
@@ -52,10 +58,16 @@ class TransformNode {
 protected:
 
   // information about this node's transformation
+  Mat4d    local;  // relative to the parent
   Mat4d    xform;
-  Mat4d    inverse;
   Mat3d    normi;
 
+  // What xform does, most specific first.  Rays are moved into local
+  // space by the cheapest routine that covers it.
+  enum Kind { IDENTITY, TRANSLATION, UNIFORM_SCALE, GENERAL };
+  Kind     kind;
+  double   inv[12];  // rows of xform's inverse, an affine 3x4 matrix
+
   // information about parent & children
   TransformNode *parent;
   std::vector<TransformNode*> children;
@@ -75,13 +87,46 @@ protected:
   }
     
   // Coordinate-Space transformation
-  Vec3d globalToLocalCoords(const Vec3d &v) { return inverse * v; }
+  Vec3d globalToLocalCoords(const Vec3d &v) const {
+    switch (kind) {
+    case IDENTITY:      return v;
+    case TRANSLATION:   return Vec3d(v[0] + inv[3], v[1] + inv[7], v[2] + inv[11]);
+    case UNIFORM_SCALE: return Vec3d(inv[0]*v[0] + inv[3], inv[0]*v[1] + inv[7], inv[0]*v[2] + inv[11]);
+    default:            return Vec3d(inv[0]*v[0] + inv[1]*v[1] + inv[2]*v[2] + inv[3],
+                                     inv[4]*v[0] + inv[5]*v[1] + inv[6]*v[2] + inv[7],
+                                     inv[8]*v[0] + inv[9]*v[1] + inv[10]*v[2] + inv[11]);
+    }
+  }
+
+  // A world-space ray from p along d in local space: its origin pos, unit
+  // direction dir, and the local length of one world unit along it.
+  void globalToLocalRay(const Vec3d& p, const Vec3d& d, Vec3d& pos, Vec3d& dir, double& length) const {
+    pos = globalToLocalCoords(p);
+    switch (kind) {
+    case IDENTITY:
+    case TRANSLATION:   dir = d; break;
+    case UNIFORM_SCALE: dir = inv[0] * d; break;
+    default:            dir = Vec3d(inv[0]*d[0] + inv[1]*d[1] + inv[2]*d[2],
+                                    inv[4]*d[0] + inv[5]*d[1] + inv[6]*d[2],
+                                    inv[8]*d[0] + inv[9]*d[1] + inv[10]*d[2]);
+    }
+    length = dir.length();
+    if (length != 1.0) dir /= length;
+  }
 
   Vec3d localToGlobalCoords(const Vec3d &v) { return xform * v; }
 
   Vec4d localToGlobalCoords(const Vec4d &v) { return xform * v; }
 
-  Vec3d localToGlobalCoordsNormal(const Vec3d &v) {
+  // v must be unit length, as the normals from intersectLocal are; only
+  // a general transform has to renormalize.
+  Vec3d localToGlobalCoordsNormal(const Vec3d &v) const {
+    switch (kind) {
+    case IDENTITY:
+    case TRANSLATION:   return v;
+    case UNIFORM_SCALE: return inv[0] < 0.0 ? -v : v;
+    default:            break;
+    }
     Vec3d ret = normi * v;
     ret.normalize();
     return ret;
@@ -89,17 +134,43 @@ protected:
 
   const Mat4d& transform() const		{ return xform; }
 
+  // Replace this node's transformation relative to its parent; the change
+  // carries down to every node below it.  Call Scene::updateBounds()
+  // afterwards so the acceleration structures catch up.
+  void setTransform(const Mat4d& m) {
+    local = m;
+    update();
+  }
+
 protected:
   // protected so that users can't directly construct one of these...
   // force them to use the createChild() method.  Note that they CAN
   // directly create a TransformRoot object.
  TransformNode(TransformNode *parent, const Mat4d& xform ) : children() {
       this->parent = parent;
-      if (parent == NULL) this->xform = xform;
-      else this->xform = parent->xform * xform;  
-      inverse = this->xform.inverse();
-      normi = this->xform.upper33().inverse().transpose();
+      local = xform;
+      update();
     }
+
+  void update() {
+      if (parent == NULL) xform = local;
+      else xform = parent->xform * local;
+      Mat4d inverse = xform.inverse();
+      for (int k = 0; k < 12; ++k) inv[k] = inverse[k / 4][k % 4];
+      normi = xform.upper33().inverse().transpose();
+      classify();
+      for(child_iter c = children.begin(); c != children.end(); ++c ) (*c)->update();
+    }
+
+  void classify() {
+    const double* m = inv;
+    bool diagonal = m[1] == 0.0 && m[2] == 0.0 && m[4] == 0.0 && m[6] == 0.0 && m[8] == 0.0 && m[9] == 0.0;
+    bool uniform = diagonal && m[0] == m[5] && m[0] == m[10];
+    bool moved = m[3] != 0.0 || m[7] != 0.0 || m[11] != 0.0;
+    if (uniform && m[0] == 1.0) kind = moved ? TRANSLATION : IDENTITY;
+    else if (uniform && m[0] != 0.0) kind = UNIFORM_SCALE;
+    else kind = GENERAL;
+  }
 };
 
 class TransformRoot : public TransformNode {
@@ -117,9 +188,38 @@ protected:
   // do not call directly - this should only be called by intersect()
   virtual bool intersectLocal(ray& r, isect& i ) const = 0;
 
+  // Is there any hit closer than tmax (in local units)?  The default
+  // runs intersectLocal; objects override it when they can answer
+  // without building a hit record and material.
+  virtual bool occludedLocal(ray& r, double tmax) const;
+
+  // The packet's rays in active, already in local space, against this
+  // object: replace the hit records it beats and return those rays.  The
+  // default runs intersectLocal on each ray.
+  virtual RayPacket::Mask intersectLocal(RayPacket& p, RayPacket::Mask active) const;
+  // true if intersectLocal above is overridden with something better than
+  // a ray at a time; if not, packets skip moving into local space as one.
+  virtual bool hasPacketIntersect() const { return false; }
+
+  // Fill in, still in local space, whatever of the hit record intersectLocal
+  // left to be worked out only for the closest hit (see finalize()).
+  virtual void finalizeLocal(isect& /*i*/) const {}
+
 public:
   // intersections performed in the global coordinate space.
   bool intersect(ray& r, isect& i) const;
+  // The same for the rays of p in active, whose records are replaced
+  // where this object is closer; returns those rays.
+  RayPacket::Mask intersect(RayPacket& p, RayPacket::Mask active) const;
+  // true if anything lies along r before distance tmax; for shadow rays,
+  // which only care whether something is in the way.
+  bool occluded(ray& r, double tmax) const;
+
+  // Hits come out of intersect() with only what it takes to pick the
+  // closest: the distance, and for meshes the triangle and barycentrics,
+  // with the normal left in local space.  The scene calls this on the one
+  // a ray keeps, to complete it and take the normal to world space.
+  void finalize(isect& i) const;
 
   virtual bool hasBoundingBoxCapability() const;
   const BoundingBox& getBoundingBox() const { return bounds; }
@@ -195,6 +295,10 @@ class SceneObject : public Geometry {
   virtual const Material& getMaterial() const = 0;
   virtual void setMaterial(Material *m) = 0;
 
+  // The material at hit i, for objects whose hits don't carry one;
+  // anything computed for it goes in blend.
+  virtual const Material& materialAt(const isect& /*i*/, Material& /*blend*/) const { return getMaterial(); }
+
   void glDraw(int quality, bool actualMaterials, bool actualTextures) const;
 
  protected:
@@ -219,6 +323,36 @@ protected:
   Material* material;
 };
 
+// BVH leaves hand scene objects the whole packet.
+inline RayPacket::Mask intersectPacket(const Geometry& g, RayPacket& p, RayPacket::Mask live) {
+  return g.intersect(p, live);
+}
+
+// Running totals over the triangle meshes loaded, so the loader can
+// report what their geometry costs in memory.  Instances share their
+// definition's geometry and aren't counted again.
+struct MeshStats {
+	MeshStats() : meshes(0), triangles(0), bytes(0) {}
+
+	void add(int tris, size_t b) {
+		++meshes;
+		triangles += tris;
+		bytes += b;
+	}
+
+	void print(std::ostream& os) const {
+		if (meshes == 0) return;
+		os << "mesh geometry: " << meshes << (meshes == 1 ? " mesh, " : " meshes, ")
+		   << triangles << " triangles, " << bytes << " bytes ("
+		   << (triangles ? double(bytes) / triangles : 0.0) << " bytes/triangle), "
+		   << (sizeof(Real) == sizeof(float) ? "float" : "double") << " vertices" << std::endl;
+	}
+
+	int meshes;
+	int triangles;
+	size_t bytes;
+};
+
 class Scene {
 
 public:
@@ -229,7 +363,10 @@ public:
 
   TransformRoot transformRoot;
 
-  Scene() : transformRoot(), objects(), lights() {}
+  // The acceleration structures Scene::intersect can search with.
+  enum Accelerator { LINEAR, BVH_TREE, KD_TREE, GRID };
+
+  Scene() : transformRoot(), objects(), lights(), accelerator(LINEAR), kdtree(0), bvh(0), grid(0) {}
   virtual ~Scene();
 
   void add( Geometry* obj ) {
@@ -240,6 +377,12 @@ public:
   void add(Light* light) { lights.push_back(light); }
 
   bool intersect(ray& r, isect& i) const;
+  // Find the closest hit of every ray in p, as intersect() would; the
+  // rays that hit something are set in p.found.
+  void intersect(RayPacket& p) const;
+  // Any hit along r closer than tmax; stops at the first one found,
+  // which is stored in blocker if one is given.
+  bool occluded(ray& r, double tmax, const Geometry** blocker = 0) const;
 
   std::vector<Light*>::const_iterator beginLights() const { return lights.begin(); }
   std::vector<Light*>::const_iterator endLights() const { return lights.end(); }
@@ -265,7 +408,41 @@ public:
 
   const BoundingBox& bounds() const { return sceneBounds; }
 
+  // Sort the bounded objects into a bounding volume hierarchy, kd-tree or
+  // uniform grid over bounds(); anything without hasBoundingBoxCapability()
+  // is kept aside and tested every time.  The kd-tree takes its depth and
+  // leaf size from the UI.
   void buildKdTree();
+  void buildBVH();
+  void buildGrid();
+
+  // Switch Scene::intersect to another acceleration structure, building
+  // it first if it doesn't exist yet (or was built with other settings),
+  // or whenever rebuild is set.
+  void setAccelerator(int accel, bool rebuild = false);
+  int getAccelerator() const { return accelerator; }
+
+  // Recompute object and scene bounds after TransformNode matrices have
+  // changed.  The BVH is refit in place and only rebuilt if that made it
+  // much worse; a kd-tree or grid is rebuilt.  Mesh hierarchies live in object
+  // space and are unaffected.  Returns false if the BVH had to be rebuilt.
+  bool updateBounds();
+
+  // Meshes add the cost of their own hierarchies here as they are built,
+  // so the loader can report the total alongside the scene-level tree.
+  void addMeshBVHStats(const BVHStats& s) { meshBVHStats += s; }
+  void addMeshStats(int triangles, size_t bytes) { meshStats.add(triangles, bytes); }
+  void printAcceleratorStats(std::ostream& os) const;
+
+  // Memory held by the current acceleration structure, and by the meshes'
+  // geometry and hierarchies; -B compares them across builds.
+  size_t acceleratorBytes() const;
+  size_t meshBytes() const { return meshStats.bytes + meshBVHStats.bytes; }
+
+  // How often each light's last-occluder cache answered a shadow ray,
+  // since the last reset.
+  void printShadowStats(std::ostream& os) const;
+  void resetShadowStats();
 
  private:
   std::vector<Geometry*> objects;
@@ -286,7 +463,14 @@ public:
   // are exempt from this requirement.
   BoundingBox sceneBounds;
   
+  void splitBoundedObjects();
+
+  int accelerator;
   KdTree<Geometry>* kdtree;
+  BVH<Geometry>* bvh;
+  Grid<Geometry>* grid;
+  BVHStats meshBVHStats;
+  MeshStats meshStats;
 
  public:
   // This is used for debugging purposes only.
@@ -1,6 +1,9 @@
 #include <iostream>
 #include <time.h>
 #include <stdarg.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
 
 #include <assert.h>
 
@@ -8,19 +11,20 @@
 #include "../fileio/bitmap.h"
 
 #include "../RayTracer.h"
+#include "../scene/scene.h"
 
 using namespace std;
 
 // The command line UI simply parses out all the arguments off
 // the command line and stores them locally.
 CommandLineUI::CommandLineUI( int argc, char* const* argv )
-	: TraceUI()
+	: TraceUI(), m_benchmark( false ), m_triangleBenchmark( false ), m_singleRays( false )
 {
 	int i;
 
 	progName=argv[0];
 
-	while( (i = getopt( argc, argv, "tr:w:h:" )) != EOF )
+	while( (i = getopt( argc, argv, "tr:w:h:a:d:l:b:q:fsBTSW" )) != EOF )
 	{
 		switch( i )
 		{
@@ -31,6 +35,68 @@ CommandLineUI::CommandLineUI( int argc, char* const* argv )
 			case 'w':
 				m_nSize = atoi( optarg );
 				break;
+
+			case 'a':
+				if( !strcmp( optarg, "linear" ) ) m_nAccelerator = 0;
+				else if( !strcmp( optarg, "bvh" ) ) m_nAccelerator = 1;
+				else if( !strcmp( optarg, "kd" ) ) m_nAccelerator = 2;
+				else if( !strcmp( optarg, "grid" ) ) m_nAccelerator = 3;
+				else {
+					std::cerr << "Unknown acceleration structure: '" << optarg << "'." << std::endl;
+					usage();
+					exit(1);
+				}
+				break;
+
+			case 'd':
+				m_nTreeDepth = atoi( optarg );
+				break;
+
+			case 'l':
+				m_nLeafSize = atoi( optarg );
+				break;
+
+			case 'b':
+				m_nBVHWidth = atoi( optarg );
+				if( m_nBVHWidth != 2 && m_nBVHWidth != 4 && m_nBVHWidth != 8 ) {
+					std::cerr << "BVH width must be 2, 4 or 8." << std::endl;
+					usage();
+					exit(1);
+				}
+				break;
+
+			case 'q':
+				m_nBVHQuant = atoi( optarg );
+				if( m_nBVHQuant != 8 && m_nBVHQuant != 16 ) {
+					std::cerr << "BVH bound quantization must be 8 or 16 bits." << std::endl;
+					usage();
+					exit(1);
+				}
+				break;
+
+			case 'f':
+				m_nBVHBuild = 1;
+				break;
+
+			case 's':
+				m_nBVHBuild = 2;
+				break;
+
+			case 'B':
+				m_benchmark = true;
+				break;
+
+			case 'T':
+				m_triangleBenchmark = true;
+				break;
+
+			case 'S':
+				m_singleRays = true;
+				break;
+
+			case 'W':
+				m_streamSecondary = true;
+				break;
 			default:
 			// Oops; unknown argument
 			std::cerr << "Invalid argument: '" << i << "'." << std::endl;
@@ -56,19 +122,23 @@ int CommandLineUI::run()
 
 	if( raytracer->sceneLoaded() )
 	{
+		if( m_triangleBenchmark )
+		{
+			raytracer->benchmarkTriangles( std::cout );
+			return 0;
+		}
+
 		int width = m_nSize;
 		int height = (int)(width / raytracer->aspectRatio() + 0.5);
 
-		raytracer->traceSetup( width, height );
-
-		clock_t start, end;
-		start = clock();
-
-		for( int j = 0; j < height; ++j )
-			for( int i = 0; i < width; ++i )
-//				raytracer->tracePixel(i,j);
-
-		end=clock();
+		double t = 0.0;
+		if( m_benchmark )
+			benchmark( width, height );
+		else
+		{
+			raytracer->traceSetup( width, height );
+			t = render( width, height );
+		}
 
 		// save image
 		unsigned char* buf;
@@ -78,9 +148,13 @@ int CommandLineUI::run()
 		if (buf)
 			writeBMP(imgName, width, height, buf);
 
-		double t=(double)(end-start)/CLOCKS_PER_SEC;
-//		int totalRays = TraceUI::resetCount();
-//		std::cout << "total time = " << t << " seconds, rays traced = " << totalRays << std::endl;
+		if( !m_benchmark )
+		{
+			std::cout << "total time = " << t << " seconds" << std::endl;
+			raytracer->printShadowStats( std::cout );
+			raytracer->printStreamStats( std::cout );
+			raytracer->printAllocStats( std::cout );
+		}
         return 0;
 	}
 	else
@@ -90,6 +164,64 @@ int CommandLineUI::run()
 	}
 }
 
+// Trace every pixel, in 8x8 tiles unless -S was given; returns the time
+// it took in seconds.
+double CommandLineUI::render( int width, int height )
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	if( m_singleRays )
+	{
+		for( int j = 0; j < height; ++j )
+			for( int i = 0; i < width; ++i )
+				raytracer->tracePixel(i,j);
+	}
+	else
+	{
+		for( int j = 0; j < height; j += 8 )
+			for( int i = 0; i < width; i += 8 )
+				raytracer->traceTile( i, j, std::min( i+8, width ), std::min( j+8, height ) );
+	}
+
+	return std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+}
+
+// Render the scene once with each acceleration structure, rebuilding it
+// first (even the one chosen with -a, already built while loading) so
+// the build is timed apart from the render.  Both times are wall-clock,
+// since the BVH builds on several threads.  The structure that renders
+// fastest wins.  Memory is reported with the precision geometry is stored
+// in, so the output of a -DRAY_SINGLE_PRECISION build compares directly
+// with a default one.
+void CommandLineUI::benchmark( int width, int height )
+{
+	static const char* names[] = { "linear", "bvh", "kd", "grid" };
+	int best = -1;
+	double bestTime = 0.0;
+
+	std::cout << ( sizeof( Real ) == sizeof( float ) ? "float" : "double" ) << " geometry: meshes "
+		<< raytracer->scene->meshBytes() << " bytes" << std::endl;
+
+	for( int a = 0; a < 4; ++a )
+	{
+		m_nAccelerator = a;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		raytracer->scene->setAccelerator( a, true );
+		double build = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+		raytracer->traceSetup( width, height );
+		double t = render( width, height );
+
+		std::cout << names[a] << ": build " << build << " seconds, render " << t << " seconds ("
+			<< width * height / t << " pixels/s), " << raytracer->scene->acceleratorBytes() << " bytes" << std::endl;
+		if( best < 0 || t < bestTime )
+		{
+			best = a;
+			bestTime = t;
+		}
+	}
+	std::cout << "fastest for " << rayName << ": " << names[best] << std::endl;
+}
+
 void CommandLineUI::alert( const string& msg )
 {
 	std::cerr << msg << std::endl;
@@ -100,4 +232,16 @@ void CommandLineUI::usage()
 	std::cerr << "usage: " << progName << " [options] [input.ray output.bmp]" << std::endl;
 	std::cerr << "  -r <#>      set recursion level (default " << m_nDepth << ")" << std::endl; 
 	std::cerr << "  -w <#>      set output image width (default " << m_nSize << ")" << std::endl;
+	std::cerr << "  -a <accel>  acceleration structure: linear, bvh, kd or grid (default bvh)" << std::endl;
+	std::cerr << "  -d <#>      set kd-tree max depth (default " << m_nTreeDepth << ")" << std::endl;
+	std::cerr << "  -l <#>      set kd-tree leaf size (default " << m_nLeafSize << ")" << std::endl;
+	std::cerr << "  -b <#>      set BVH branching factor: 2, 4 or 8 (default " << m_nBVHWidth << ")" << std::endl;
+	std::cerr << "  -q <#>      quantize wide BVH child bounds to 8 or 16 bits" << std::endl;
+	std::cerr << "  -f          fast Morton-code (LBVH) build instead of SAH" << std::endl;
+	std::cerr << "  -s          SAH build with spatial splits (SBVH)" << std::endl;
+	std::cerr << "  -B          benchmark: render with every accelerator, report speed, memory and the fastest" << std::endl;
+	std::cerr << "  -T          time packed against one-at-a-time triangle tests, no render" << std::endl;
+	std::cerr << "  -S          trace primary rays one at a time instead of in 8x8 packets" << std::endl;
+	std::cerr << "  -W          trace each tile's reflected and refracted rays as sorted streams" << std::endl;
+	std::cerr << "              (currently slower on small scenes: scene_mirror 0.86s vs 0.63s)" << std::endl;
 }
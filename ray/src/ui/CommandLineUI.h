@@ -30,10 +30,15 @@ public:
 
 private:
 	void		usage();
+	double		render( int width, int height );
+	void		benchmark( int width, int height );
 
 	char*	rayName;
 	char*	imgName;
 	char*	progName;
+	bool	m_benchmark;	// render once per accelerator and report the fastest
+	bool	m_triangleBenchmark;	// time the triangle tests instead of rendering
+	bool	m_singleRays;	// trace pixel by pixel rather than in 8x8 packets
 };
 
 #endif
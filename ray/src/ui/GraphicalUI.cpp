@@ -7,6 +7,7 @@
 #include <time.h>
 #include <string.h>
 #include <stdarg.h>
+#include <algorithm>
 
 #ifndef COMMAND_LINE_ONLY
 
@@ -159,6 +160,42 @@ void GraphicalUI::cb_filterSlides(Fl_Widget* o, void* v) {
 	pUI->m_nFilterWidth=int(((Fl_Slider *)o)->value());
 }
 
+void GraphicalUI::cb_treeDepthSlides(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_nTreeDepth=int( ((Fl_Slider *)o)->value() ) ;
+}
+
+void GraphicalUI::cb_leafSizeSlides(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_nLeafSize=int( ((Fl_Slider *)o)->value() ) ;
+}
+
+void GraphicalUI::cb_accelChoice(Fl_Widget* o, void* v)
+{
+	pUI=(GraphicalUI*)(o->user_data());
+	pUI->m_nAccelerator=((Fl_Choice*)o)->value();
+}
+
+void GraphicalUI::cb_bvhWidthChoice(Fl_Widget* o, void* v)
+{
+	static const int widths[] = { 2, 4, 8 };
+	pUI=(GraphicalUI*)(o->user_data());
+	pUI->m_nBVHWidth=widths[((Fl_Choice*)o)->value()];
+}
+
+void GraphicalUI::cb_bvhBuildChoice(Fl_Widget* o, void* v)
+{
+	pUI=(GraphicalUI*)(o->user_data());
+	pUI->m_nBVHBuild=((Fl_Choice*)o)->value();
+}
+
+void GraphicalUI::cb_bvhQuantChoice(Fl_Widget* o, void* v)
+{
+	static const int bits[] = { 0, 16, 8 };
+	pUI=(GraphicalUI*)(o->user_data());
+	pUI->m_nBVHQuant=bits[((Fl_Choice*)o)->value()];
+}
+
 void GraphicalUI::cb_debuggingDisplayCheckButton(Fl_Widget* o, void* v)
 {
 	pUI=(GraphicalUI*)(o->user_data());
@@ -203,6 +240,12 @@ void GraphicalUI::cb_shCheckButton(Fl_Widget* o, void* v)
 	  }
 }
 
+void GraphicalUI::cb_streamCheckButton(Fl_Widget* o, void* v)
+{
+	pUI=(GraphicalUI*)(o->user_data());
+	pUI->m_streamSecondary = (((Fl_Check_Button*)o)->value() == 1);
+}
+
 void GraphicalUI::cb_aaCheckButton(Fl_Widget* o, void* v)
 {
 	pUI=(GraphicalUI*)(o->user_data());
@@ -231,11 +274,11 @@ void GraphicalUI::cb_cmCheckButton(Fl_Widget* o, void* v)
 	  }
 }
 
-void GraphicalUI::helperTrace(int start, int end, int y) {
+void GraphicalUI::helperTrace(int x0, int x1, int y0, int y1) {
 	stopTrace = false;
-	for(int x=start; x < end; x++) {
+	for(int x=x0; x < x1; x+=8) {
 		if (stopTrace) break;
-		pUI->raytracer->tracePixel(x,y);
+		pUI->raytracer->traceTile(x, y0, std::min(x+8, x1), y1);
 		pUI->m_debuggingWindow->m_debuggingView->setDirty();
 	}
 }
@@ -262,12 +305,13 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 		now = prev = clock();
 		clock_t intervalMS = pUI->refreshInterval * 100;
 		int step = pUI->getThreadNum();
-		int size = width/step;
-		int start = 0;
-		int end = size;
+		// The image is traced in 8x8 tiles, a row of tiles at a time;
+		// each thread gets a run of whole tiles from that row.
+		int tiles = (width + 7) / 8;
+		int size = (tiles + step - 1) / step * 8;
 		thread t[step];
 
-		for (int y = 0; y < height; y++)
+		for (int y = 0; y < height; y += 8)
 		  {
 				// check for input and refresh view every so often while tracing
 				now = clock();
@@ -284,15 +328,10 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 				// look for input and refresh window
 				for(int i = 0; i < step; i++) {
 					if (stopTrace) break;
-					t[i] = thread(helperTrace,start,end,y);
-					if(end == width) {
-						start = 0;
-						end = size;
-					}
-					else {
-						start = end;
-						end += size;
-					}
+					int start = i * size;
+					if (start >= width) break;
+					t[i] = thread(helperTrace, start, std::min(start + size, width),
+						y, std::min(y + 8, height));
 				}
 
 				//joins threads if they are joinable
@@ -472,6 +511,68 @@ GraphicalUI::GraphicalUI() : refreshInterval(10) {
 	m_filterSlider->callback(cb_filterSlides);
 	m_filterSlider->deactivate();
 
+	//install acceleration structure chooser
+	m_accelChoice = new Fl_Choice(100, 260, 100, 20, "Accelerator");
+	m_accelChoice->user_data((void*)(this));
+	m_accelChoice->labelfont(FL_COURIER);
+	m_accelChoice->labelsize(12);
+	m_accelChoice->add("Linear|BVH|Kd-tree|Grid");
+	m_accelChoice->value(m_nAccelerator);
+	m_accelChoice->callback(cb_accelChoice);
+
+	//install BVH branching factor chooser
+	m_bvhWidthChoice = new Fl_Choice(290, 260, 90, 20, "BVH Width");
+	m_bvhWidthChoice->user_data((void*)(this));
+	m_bvhWidthChoice->labelfont(FL_COURIER);
+	m_bvhWidthChoice->labelsize(12);
+	m_bvhWidthChoice->add("Binary|4-wide|8-wide");
+	m_bvhWidthChoice->value(m_nBVHWidth == 8 ? 2 : m_nBVHWidth == 4 ? 1 : 0);
+	m_bvhWidthChoice->callback(cb_bvhWidthChoice);
+
+	//install kd-tree depth slider
+	m_treeDepthSlider = new Fl_Value_Slider(10, 285, 180, 20, "Kd-tree Max Depth");
+	m_treeDepthSlider->user_data((void*)(this));	// record self to be used by static callback functions
+	m_treeDepthSlider->type(FL_HOR_NICE_SLIDER);
+	m_treeDepthSlider->labelfont(FL_COURIER);
+	m_treeDepthSlider->labelsize(12);
+	m_treeDepthSlider->minimum(1);
+	m_treeDepthSlider->maximum(30);
+	m_treeDepthSlider->step(1);
+	m_treeDepthSlider->value(m_nTreeDepth);
+	m_treeDepthSlider->align(FL_ALIGN_RIGHT);
+	m_treeDepthSlider->callback(cb_treeDepthSlides);
+
+	//install kd-tree leaf size slider
+	m_leafSizeSlider = new Fl_Value_Slider(10, 310, 180, 20, "Kd-tree Leaf Size");
+	m_leafSizeSlider->user_data((void*)(this));	// record self to be used by static callback functions
+	m_leafSizeSlider->type(FL_HOR_NICE_SLIDER);
+	m_leafSizeSlider->labelfont(FL_COURIER);
+	m_leafSizeSlider->labelsize(12);
+	m_leafSizeSlider->minimum(1);
+	m_leafSizeSlider->maximum(100);
+	m_leafSizeSlider->step(1);
+	m_leafSizeSlider->value(m_nLeafSize);
+	m_leafSizeSlider->align(FL_ALIGN_RIGHT);
+	m_leafSizeSlider->callback(cb_leafSizeSlides);
+
+	//install BVH builder chooser
+	m_bvhBuildChoice = new Fl_Choice(100, 335, 100, 20, "BVH Build");
+	m_bvhBuildChoice->user_data((void*)(this));
+	m_bvhBuildChoice->labelfont(FL_COURIER);
+	m_bvhBuildChoice->labelsize(12);
+	m_bvhBuildChoice->add("SAH|LBVH|SBVH");
+	m_bvhBuildChoice->value(m_nBVHBuild);
+	m_bvhBuildChoice->callback(cb_bvhBuildChoice);
+
+	//install BVH node compression chooser
+	m_bvhQuantChoice = new Fl_Choice(290, 335, 90, 20, "Bounds");
+	m_bvhQuantChoice->user_data((void*)(this));
+	m_bvhQuantChoice->labelfont(FL_COURIER);
+	m_bvhQuantChoice->labelsize(12);
+	m_bvhQuantChoice->add("Float|16-bit|8-bit");
+	m_bvhQuantChoice->value(m_nBVHQuant == 8 ? 2 : m_nBVHQuant == 16 ? 1 : 0);
+	m_bvhQuantChoice->callback(cb_bvhQuantChoice);
+
 	//install smoothshading button
 	m_ssCheckButton = new Fl_Check_Button(10, 400, 140, 20, "Smoothshade");
 	m_ssCheckButton->user_data((void*)(this));
@@ -490,6 +591,13 @@ GraphicalUI::GraphicalUI() : refreshInterval(10) {
 	m_debuggingDisplayCheckButton->callback(cb_debuggingDisplayCheckButton);
 	m_debuggingDisplayCheckButton->value(m_displayDebuggingInfo);
 
+	// set up secondary ray streaming checkbox (same as -W)
+	m_streamCheckButton = new Fl_Check_Button(150, 429, 140, 20, "Stream bounces");
+	m_streamCheckButton->user_data((void*)(this));
+	m_streamCheckButton->callback(cb_streamCheckButton);
+	m_streamCheckButton->value(m_streamSecondary);
+	m_streamCheckButton->tooltip("Trace each tile's reflected and refracted rays as sorted streams. Currently slower on small scenes.");
+
 	m_mainWindow->callback(cb_exit2);
 	m_mainWindow->when(FL_HIDE);
 	m_mainWindow->end();
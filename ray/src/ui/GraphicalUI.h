@@ -13,6 +13,7 @@
 #include <FL/Fl_Value_Slider.H>
 #include <FL/Fl_Check_Button.H>
 #include <FL/Fl_Button.H>
+#include <FL/Fl_Choice.H>
 #include <FL/Fl_File_Chooser.H>
 
 #include "TraceUI.h"
@@ -55,6 +56,12 @@ public:
 	Fl_Check_Button*	m_ssCheckButton;
 	Fl_Check_Button*	m_shCheckButton;
 	Fl_Check_Button*	m_bfCheckButton;
+	Fl_Check_Button*	m_streamCheckButton;
+
+	Fl_Choice*			m_accelChoice;
+	Fl_Choice*			m_bvhWidthChoice;
+	Fl_Choice*			m_bvhBuildChoice;
+	Fl_Choice*			m_bvhQuantChoice;
 
 	Fl_Button*			m_renderButton;
 	Fl_Button*			m_stopButton;
@@ -100,6 +107,12 @@ private:
 	static void cb_thread(Fl_Widget* o, void* v);
 	static void cb_aaSlides(Fl_Widget* o, void* v);
 	static void cb_filterSlides(Fl_Widget* o, void* v);
+	static void cb_treeDepthSlides(Fl_Widget* o, void* v);
+	static void cb_leafSizeSlides(Fl_Widget* o, void* v);
+	static void cb_accelChoice(Fl_Widget* o, void* v);
+	static void cb_bvhWidthChoice(Fl_Widget* o, void* v);
+	static void cb_bvhBuildChoice(Fl_Widget* o, void* v);
+	static void cb_bvhQuantChoice(Fl_Widget* o, void* v);
 
 	static void cb_render(Fl_Widget* o, void* v);
 	static void cb_stop(Fl_Widget* o, void* v);
@@ -109,8 +122,9 @@ private:
 	static void cb_ssCheckButton(Fl_Widget* o, void* v);
 	static void cb_shCheckButton(Fl_Widget* o, void* v);
 	static void cb_bfCheckButton(Fl_Widget* o, void* v);
+	static void cb_streamCheckButton(Fl_Widget* o, void* v);
 
-	static void helperTrace(int start, int end, int y);
+	static void helperTrace(int x0, int x1, int y0, int y1);
 
 	static bool stopTrace;
 	static bool doneTrace;
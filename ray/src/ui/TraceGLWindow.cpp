@@ -45,7 +45,7 @@ int TraceGLWindow::handle(int event)
 				raytracer->traceSetup(m_nWindowWidth, m_nWindowHeight);
 
 			debugMode = true;
-			raytracer->tracePixel(x, y);
+			raytracer->traceTile(x, y, x + 1, y + 1);
 
 			((GraphicalUI*) traceUI)->m_debuggingWindow->m_debuggingView->redraw();
 			debugMode = false;
@@ -20,9 +20,11 @@ class RayTracer;
 
 class TraceUI {
 public:
-	TraceUI() : m_nDepth(0), m_nSize(512), m_nThreads(thread::hardware_concurrency()),m_nSample(1),m_displayDebuggingInfo(false),
-                    m_shadows(true), m_smoothshade(true), raytracer(0),
-                    m_nFilterWidth(1)
+	TraceUI() : raytracer(0), m_nSize(512), m_nDepth(0), m_nSample(1), m_nThreads(thread::hardware_concurrency()),
+                    m_displayDebuggingInfo(false), m_antialiasing(false), m_shadows(true), m_smoothshade(true),
+                    m_usingCubeMap(false), m_gotCubeMap(false),
+                    m_nFilterWidth(1), m_nAccelerator(1), m_nTreeDepth(15), m_nLeafSize(10),
+                    m_nBVHWidth(2), m_nBVHBuild(0), m_nBVHQuant(0), m_streamSecondary(false)
                     {
                     	// m_nThreads = thread::hardware_concurrency()-2;makmk
                     }
@@ -42,6 +44,14 @@ public:
 	int	getSize() const { return m_nSize; }
 	int	getDepth() const { return m_nDepth; }
 	int		getFilterWidth() const { return m_nFilterWidth; }
+	int		getAccelerator() const { return m_nAccelerator; }
+	int		getMaxDepth() const { return m_nTreeDepth; }
+	int		getLeafSize() const { return m_nLeafSize; }
+	int		getBVHWidth() const { return m_nBVHWidth; }
+	int		getThreads() const { return m_nThreads; }
+	int		getBVHBuild() const { return m_nBVHBuild; }
+	int		getBVHQuant() const { return m_nBVHQuant; }
+	bool	streamSecondary() const { return m_streamSecondary; }
 
 	bool	cm() const{ return m_usingCubeMap; } 	
 	bool	shadowSw() const { return m_shadows; }
@@ -68,6 +78,13 @@ protected:
 	bool		m_usingCubeMap;  // render with cubemap
 	bool		m_gotCubeMap;  // cubemap defined
 	int m_nFilterWidth;  // width of cubemap filter
+	int m_nAccelerator;  // Scene::Accelerator: 0 = linear, 1 = BVH, 2 = kd-tree, 3 = grid
+	int m_nTreeDepth;  // max depth of the kd-tree
+	int m_nLeafSize;  // target number of objects per kd-tree leaf
+	int m_nBVHWidth;  // BVH branching factor: 2, 4 or 8 (meshes pick it up on load)
+	int m_nBVHBuild;  // BVH<Obj>::Builder: 0 = binned SAH, 1 = Morton codes (LBVH), 2 = SAH with spatial splits (SBVH)
+	int m_nBVHQuant;  // bits per quantized BVH child bound: 8 or 16, or 0 for floats
+	bool m_streamSecondary;  // trace each tile's reflected and refracted rays as sorted streams
 };
 
 #endif
@@ -355,17 +355,17 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 		glNewList( displayList, GL_COMPILE );
 
 		glBegin( GL_TRIANGLES );
-		for( Faces::const_iterator itr = faces.begin(); itr != faces.end(); ++itr )
+		for( Faces::const_iterator itr = mesh->faces.begin(); itr != mesh->faces.end(); ++itr )
 		{
-			const int vert1 = (*(*itr))[0];
-			const int vert2 = (*(*itr))[1];
-			const int vert3 = (*(*itr))[2];
+			const int vert1 = (*itr)[0];
+			const int vert2 = (*itr)[1];
+			const int vert3 = (*itr)[2];
 
-			if( normals.empty() )
+			if( mesh->normals.empty() )
 			{
-				const Vec3d& a = vertices[vert1];
-				const Vec3d& b = vertices[vert2];
-				const Vec3d& c = vertices[vert3];
+				Vec3d a = mesh->vertex(vert1);
+				Vec3d b = mesh->vertex(vert2);
+				Vec3d c = mesh->vertex(vert3);
 
 				Vec3d cv=(b - a) ^ (c - a);
 
@@ -375,23 +375,23 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 					glNormal3dv( cv.getPointer() );
 			}
 
-			if( ! normals.empty() )
-				glNormal3dv( normals[vert1].getPointer() );
-			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert1], *itr );
-			glVertex3dv( vertices[vert1].getPointer() );
-
-			if( ! normals.empty() )
-				glNormal3dv( normals[vert2].getPointer() );
-			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert2], *itr );
-			glVertex3dv( vertices[vert2].getPointer() );
-
-			if( ! normals.empty() )
-				glNormal3dv( normals[vert3].getPointer() );
-			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert3], *itr );
-			glVertex3dv( vertices[vert3].getPointer() );
+			if( ! mesh->normals.empty() )
+				glNormal3dv( Vec3d( mesh->normals[vert1] ).getPointer() );
+			if( !mesh->materials.empty() && actualMaterials )
+				setGLMaterial( *mesh->materials[vert1], this );
+			glVertex3dv( mesh->vertex(vert1).getPointer() );
+
+			if( ! mesh->normals.empty() )
+				glNormal3dv( Vec3d( mesh->normals[vert2] ).getPointer() );
+			if( !mesh->materials.empty() && actualMaterials )
+				setGLMaterial( *mesh->materials[vert2], this );
+			glVertex3dv( mesh->vertex(vert2).getPointer() );
+
+			if( ! mesh->normals.empty() )
+				glNormal3dv( Vec3d( mesh->normals[vert3] ).getPointer() );
+			if( !mesh->materials.empty() && actualMaterials )
+				setGLMaterial( *mesh->materials[vert3], this );
+			glVertex3dv( mesh->vertex(vert3).getPointer() );
 		}
 		glEnd();
 
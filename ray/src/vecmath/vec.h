@@ -211,6 +211,8 @@ public:
 	Vec3( int ) { n[0] = 0.0; n[1] = 0.0; n[2] = 0.0; }
 	Vec3( const Vec4<T>& v )
 		{ n[0] = v[0]; n[1] = v[1]; n[2] = v[2]; }
+	template <class U> explicit Vec3( const Vec3<U>& v )
+		{ n[0] = (T)v[0]; n[1] = (T)v[1]; n[2] = (T)v[2]; }
 
 	//---[ Equal Operators ]---------------------
 
@@ -316,6 +318,21 @@ typedef Vec3<int> Vec3i;
 typedef Vec3<float> Vec3f;
 typedef Vec3<double> Vec3d;
 
+// The scalar the ray tracer stores bulk geometry in: mesh vertices and
+// normals, the distances its binary BVH nodes are tested with, and kd-tree
+// split planes.  Build with -DRAY_SINGLE_PRECISION to make it float; -B
+// then reports the memory and render speed to set against a default build.
+// (Wide and quantized BVH nodes and triangle leaf packs are float either
+// way.)  Rays, hit records, BoundingBox, transforms, the analytic
+// primitives and shading stay double: hit distances must be good enough
+// for secondary rays to leave the surface they start on.
+#ifdef RAY_SINGLE_PRECISION
+typedef float Real;
+#else
+typedef double Real;
+#endif
+typedef Vec3<Real> Vec3r;
+
 //==========[ class Vec4 ]=================================
 
 template <class T>